@@ -0,0 +1,68 @@
+#include "include.h"
+#include "embed.h"
+#include "function.h"
+
+namespace xy {
+
+
+static status loaded (bool ok, state& s)
+{
+	status st { ok, value(), std::string() };
+	if (!ok)
+		st.error = s.error().flush();
+	return st;
+}
+
+status load_file (state& s, const std::string& filename)
+{
+	return loaded(s.load(filename), s);
+}
+
+status load_string (state& s, const std::string& source)
+{
+	return loaded(s.load_string(source), s);
+}
+
+
+
+
+prepared_function::prepared_function (state& s, const std::string& n)
+	: owner(s), name(n), func(s.global().find_function(n))
+{ }
+
+prepared_function::~prepared_function ()
+{ }
+
+
+bool prepared_function::call (value& out, const value* args, int count)
+{
+	if (func == nullptr)
+	{
+		owner.error().die() << "no " << name << " function found";
+		return false;
+	}
+
+	if (reused == nullptr || reused->size != count)
+		reused.reset(new argument_list(count));
+	for (int i = 0; i < count; i++)
+		reused->values[i] = args[i];
+
+	bool ok = func->call(out, *reused, owner);
+
+	// not keeping the arguments alive until the next call
+	for (int i = 0; i < count; i++)
+		reused->values[i] = value();
+	return ok;
+}
+
+status prepared_function::call (const value* args, int count)
+{
+	status st { true, value(), std::string() };
+	st.ok = call(st.result, args, count);
+	if (!st.ok)
+		st.error = owner.error().flush();
+	return st;
+}
+
+
+};
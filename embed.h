@@ -0,0 +1,56 @@
+#pragma once
+#include "state.h"
+#include "value.h"
+
+namespace xy {
+
+class function;
+struct argument_list;
+
+
+// how loading a program, or calling one of its functions, went: the
+// result of the call, or the error message
+struct status
+{
+	bool ok;
+	value result;
+	std::string error;
+
+	inline explicit operator bool () const { return ok; }
+};
+
+// loads a program into 's' for C++ code to call, as with state::load;
+// once the last is loaded, state::seal() lets more types be proven
+status load_file (state& s, const std::string& filename);
+status load_string (state& s, const std::string& source);
+
+
+// a function of the program loaded into a state, looked up once, then
+// called from C++ with that state as often as needed, one call at a time.
+// the thread calling it should have a stack of at least get_stack_size()
+// (see state::run), or call state::guard_stack() first
+class prepared_function
+{
+public:
+	prepared_function (state& s, const std::string& name);
+	~prepared_function ();
+
+	inline bool found () const { return func != nullptr; }
+
+	status call (const value* args, int count);
+	inline status call (const std::vector<value>& args) { return call(args.data(), args.size()); }
+	inline status call (std::initializer_list<value> args) { return call(args.begin(), args.size()); }
+
+	// the same, leaving a failure in the error handler of the state, for
+	// calls too frequent to build a status for
+	bool call (value& out, const value* args, int count);
+
+private:
+	state& owner;
+	std::string name;
+	std::shared_ptr<function> func;
+	std::unique_ptr<argument_list> reused; // of the last call's size
+};
+
+
+};
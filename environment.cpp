@@ -6,11 +6,14 @@
 namespace xy {
 
 
-environment::environment (state& p)
-	: parent(p)
-{ }
+environment::environment () {}
 
-environment::~environment () {}
+environment::~environment ()
+{
+	for (auto& f : funcs)
+		if (!f->is_native())
+			static_cast<soft_function*>(f.get())->release();
+}
 
 
 
@@ -31,16 +34,19 @@ std::shared_ptr<soft_function> environment::find_or_add (const std::string& name
 {
 	auto func(find_function(name));
 	
+	if (func != nullptr && !func->is_native())
+		return std::static_pointer_cast<soft_function>(func);
+	if (func != nullptr && !func->redefinable())
+		return nullptr;
+	
+	std::shared_ptr<soft_function> soft_func(new soft_function(name));
 	if (func == nullptr)
-	{
-		std::shared_ptr<soft_function> soft_func(new soft_function(name));
 		add_function(soft_func);
-		return soft_func;
-	}
-	else if (!func->is_native())
-		return std::static_pointer_cast<soft_function>(func);
 	else
-		return nullptr;
+		for (auto& f : funcs)
+			if (f == func)
+				f = soft_func;
+	return soft_func;
 }
 
 
@@ -11,13 +11,14 @@ class soft_function;
 class environment
 {
 public:
-	environment (state& parent);
+	environment ();
 	~environment ();
 	
 	std::shared_ptr<function> find_function (const std::string& name);
 	void add_function (const std::shared_ptr<function>& func);
 	
 	std::shared_ptr<soft_function> find_or_add (const std::string& name);
+	inline const std::vector<std::shared_ptr<function>>& functions () const { return funcs; }
 	
 	template <typename T>
 	void add_native (const std::string& name, const T& func)
@@ -27,7 +28,6 @@ public:
 	}
 	
 private:
-	state& parent;
 	std::vector<std::shared_ptr<function>> funcs;
 };
 
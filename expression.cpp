@@ -3,10 +3,13 @@
 #include "lexer.h"
 #include "state.h"
 #include "value.h"
+#include "vm.h"
+#include "jit.h"
+#include "translate.h"
 #include "function.h"
 #include "list.h"
+#include "workers.h"
 #include "syntax.h"
-#include "expression.h"
 
 namespace xy {
 
@@ -23,12 +26,100 @@ bool expression::eval_tail_call (tail_call& tc, value& out, state::scope& scope)
 }
 bool expression::locate_symbols (const std::shared_ptr<symbol_locator>& locator) { return true; }
 bool expression::constant () const { return false; }
+bool expression::is_list_literal () const { return false; }
+void expression::children (child_list& same, child_list& inner) {}
+int* expression::inner_cache_size () { return nullptr; }
+void expression::function_bodies (std::vector<std::shared_ptr<func_body>>& out) {}
+const value* expression::const_value () const { return nullptr; }
+bool expression::equivalent (const expression& other) const { return false; }
+std::shared_ptr<expression> expression::inline_copy (const child_values& params, int slot_base)
+{
+	return nullptr;
+}
+std::shared_ptr<expression> expression::specialize () { return nullptr; }
+void expression::compile (bytecode& code, bool tail)
+{
+	code.emit(tail ? bytecode::op_eval_tail : bytecode::op_eval, code.add_node(this));
+}
+bool expression::compile_native (jit_builder& code, bool tail) { return false; }
+bool expression::emit_cpp (cpp_writer& code, std::string& result, bool tail) { return false; }
+void expression::assume_type (type_facts& facts, value::value_type t) {}
+void expression::assume_true (type_facts& facts) {}
+
+// children are typed without the order in which they are evaluated, if at
+// all, and nested closures without knowing their locals
+int expression::infer (type_analysis& types, type_facts& facts)
+{
+	child_list same, inner;
+	children(same, inner);
+	for (auto c : same)
+	{
+		type_facts maybe(facts);
+		types.visit(**c, maybe);
+	}
+	for (auto c : inner)
+	{
+		type_facts none;
+		types.visit(**c, none);
+	}
+	return value::type_any;
+}
 
 
 expression::tail_call::tail_call (function* f)
-	: func(f), do_tail(false)
+	: func(f), do_tail(false), loop(false)
 { }
 
+// concatenates the pending list operands onto the final result
+bool expression::tail_call::finish (value& out, state& parent, size_t from)
+{
+	if (pending.size() <= from)
+		return true;
+	
+	auto first = pending.begin() + from;
+	bool all_lists = out.is_type(value::type_list);
+	int total = all_lists ? out.list_size() : 0;
+	for (auto p = first; p != pending.end(); p++)
+		if (!p->val.is_type(value::type_list))
+			all_lists = false;
+		else
+			total += p->val.list_size();
+	
+	if (!all_lists)
+	{
+		// apply the operators one by one, innermost first, so that
+		// errors and void operands behave exactly as without the loop
+		for (auto it = pending.rbegin(); it.base() != first; it++)
+		{
+			value acc(out);
+			bool ok = it->left ?
+				it->val.apply_operator(out, '+', acc, parent) :
+				acc.apply_operator(out, '+', it->val, parent);
+			if (!ok)
+				return false;
+		}
+		pending.resize(from);
+		return true;
+	}
+	
+	std::vector<value> vs;
+	vs.reserve(total);
+	for (auto p = first; p != pending.end(); p++)
+		if (p->left)
+			for (int i = 0, size = p->val.list_size(); i < size; i++)
+				vs.push_back(p->val.list_obj->get(i));
+	for (int i = 0, size = out.list_size(); i < size; i++)
+		vs.push_back(out.list_obj->get(i));
+	for (auto it = pending.rbegin(); it.base() != first; it++)
+		if (!it->left)
+			for (int i = 0, size = it->val.list_size(); i < size; i++)
+				vs.push_back(it->val.list_obj->get(i));
+	
+	pending.resize(from);
+	out = value::from_list(list::basic(vs));
+	return true;
+}
+
 
 
 std::ostream& symbol_locator::die ()
@@ -98,19 +189,27 @@ bool call_expression::eval_tail_call (tail_call& tc, value& out, state::scope& s
 		if (!e->eval(arg_list.values[i++], scope))
 			return false;
 	
-	if (tc.func != nullptr &&
-			func.type == value::type_function &&
-			func.func_obj.get() == tc.func)
+	if (func.type == value::type_function && !func.func_obj->is_native())
 	{
-		tc.do_tail = true;
-		for (i = 0; i < arg_list.size; i++)
-			tc.args.push_back(arg_list.values[i]);
+		// the site is left to the state that loaded the program
+		auto& target = !scope().is_primary() ? func.func_obj :
+			bind(func.func_obj, arg_list, scope());
+		if (tc.func != nullptr)
+		{
+			tc.do_tail = true;
+			tc.loop = loop_site;
+			tc.target = target;
+			for (i = 0; i < arg_list.size; i++)
+				tc.args.push_back(arg_list.values[i]);
+			
+			return true;
+		}
 		
-		return true;
-	}
-	else
 		tc.do_tail = false;
+		return target->call(out, arg_list, scope);
+	}
 	
+	tc.do_tail = false;
 	return func.call(out, arg_list, scope());
 }
 bool call_expression::eval (value& out, state::scope& scope)
@@ -119,10 +218,102 @@ bool call_expression::eval (value& out, state::scope& scope)
 	return eval_tail_call(tc, out, scope);
 }
 
+// calls made this many times in a row with one signature are bound to a
+// clone of the soft function made for it
+#define XY_CLONE_THRESHOLD  16
+
+const std::shared_ptr<function>& call_expression::bind (const std::shared_ptr<function>& func,
+		const argument_list& args, state& s)
+{
+	auto f = static_cast<soft_function*>(func.get());
+	if (func != site_callee || f->revision() != site_revision ||
+			!site_sig.matches(args))
+	{
+		site_callee = func;
+		site_sig.assign(args);
+		site_revision = f->revision();
+		site_calls = 0;
+		site_clone = nullptr;
+	}
+	
+	if (site_clone == nullptr && ++site_calls == XY_CLONE_THRESHOLD)
+		site_clone = f->clone_for(site_sig, args, s);
+	return site_clone != nullptr ? site_clone : func;
+}
+
 void call_expression::add (const std::shared_ptr<expression>& arg)
 {
 	args.push_back(arg);
 }
+void call_expression::children (child_list& same, child_list& inner)
+{
+	same.push_back(&func_exp);
+	for (auto& e : args)
+		same.push_back(&e);
+}
+bool call_expression::equivalent (const expression& other) const
+{
+	auto o = dynamic_cast<const call_expression*>(&other);
+	if (o == nullptr || o->args.size() != args.size() ||
+			!func_exp->equivalent(*o->func_exp))
+		return false;
+	
+	for (int i = 0, size = args.size(); i < size; i++)
+		if (!args[i]->equivalent(*o->args[i]))
+			return false;
+	return true;
+}
+
+std::shared_ptr<expression> call_expression::inline_copy (const child_values& params, int slot_base)
+{
+	auto f = func_exp->inline_copy(params, slot_base);
+	if (f == nullptr)
+		return nullptr;
+	
+	std::shared_ptr<call_expression> copy(new call_expression(f));
+	for (auto& e : args)
+	{
+		auto arg = e->inline_copy(params, slot_base);
+		if (arg == nullptr)
+			return nullptr;
+		copy->add(arg);
+	}
+	return copy;
+}
+
+void call_expression::compile (bytecode& code, bool tail)
+{
+	func_exp->compile(code, false);
+	for (auto& e : args)
+		e->compile(code, false);
+	code.emit(tail ? bytecode::op_tail_call : bytecode::op_call, args.size());
+}
+
+bool call_expression::compile_native (jit_builder& code, bool tail)
+{
+	return code.call(*func_exp, args, tail);
+}
+
+bool call_expression::emit_cpp (cpp_writer& code, std::string& result, bool tail)
+{
+	return code.call(result, *func_exp, args, tail);
+}
+
+int call_expression::infer (type_analysis& types, type_facts& facts)
+{
+	int t = types.visit(*func_exp, facts);
+	for (auto& e : args)
+		if (types.visit(*e, facts) == type_analysis::type_none)
+			t = type_analysis::type_none;
+	
+	if (t == type_analysis::type_none)
+		return t;
+	
+	auto v = func_exp->const_value();
+	if (v != nullptr && v->type == value::type_function)
+		return types.result(v->func_obj.get());
+	return value::type_any;
+}
 
 bool call_expression::locate_symbols (const std::shared_ptr<symbol_locator>& locator)
 {
@@ -173,6 +364,57 @@ bool list_expression::constant () const
 			return false;
 	return true;
 }
+bool list_expression::is_list_literal () const { return true; }
+void list_expression::children (child_list& same, child_list& inner)
+{
+	for (auto& e : items)
+		same.push_back(&e);
+}
+bool list_expression::equivalent (const expression& other) const
+{
+	auto o = dynamic_cast<const list_expression*>(&other);
+	if (o == nullptr || o->items.size() != items.size())
+		return false;
+	
+	for (int i = 0, size = items.size(); i < size; i++)
+		if (!items[i]->equivalent(*o->items[i]))
+			return false;
+	return true;
+}
+std::shared_ptr<expression> list_expression::inline_copy (const child_values& params, int slot_base)
+{
+	std::shared_ptr<list_expression> copy(new list_expression());
+	for (auto& e : items)
+	{
+		auto item = e->inline_copy(params, slot_base);
+		if (item == nullptr)
+			return nullptr;
+		copy->add(item);
+	}
+	return copy;
+}
+
+void list_expression::compile (bytecode& code, bool tail)
+{
+	for (auto& e : items)
+		e->compile(code, false);
+	code.emit(bytecode::op_list, items.size());
+}
+
+bool list_expression::emit_cpp (cpp_writer& code, std::string& result, bool tail)
+{
+	return code.list(result, items);
+}
+
+int list_expression::infer (type_analysis& types, type_facts& facts)
+{
+	int t = value::type_list;
+	for (auto& e : items)
+		if (types.visit(*e, facts) == type_analysis::type_none)
+			t = type_analysis::type_none;
+	return t;
+}
+
 void list_expression::add (const std::shared_ptr<expression>& arg)
 {
 	items.push_back(arg);
@@ -181,12 +423,15 @@ void list_expression::add (const std::shared_ptr<expression>& arg)
 
 
 
+// comprehensions on the workers are cut into at most this many chunks
+#define XY_COMP_CHUNKS 256
+
 list_comp_expression::list_comp_expression (const std::shared_ptr<expression>& origin, const std::string& n)
-	: it_name(n), start(origin), filter(nullptr), map(nullptr)
+	: it_name(n), start(origin), filter(nullptr), map(nullptr), parallel(false)
 { }
 bool list_comp_expression::eval (value& out, state::scope& scope)
 {
-	value list_val, item, filt_result;
+	value list_val;
 	
 	if (!start->eval(list_val, scope))
 		return false;
@@ -199,14 +444,49 @@ bool list_comp_expression::eval (value& out, state::scope& scope)
 		return false;
 	}
 	
+	std::vector<value> output;
+	list& items = *list_val.list_obj;
+	int size = items.size();
+	if (!parallel)
+	{
+		if (!eval_items(output, items, 0, size, scope))
+			return false;
+	}
+	else
+	{
+		// each chunk with an iterator closure of its own, the outputs then
+		// concatenated in order
+		int chunk = std::max(1, (size + XY_COMP_CHUNKS - 1) / XY_COMP_CHUNKS);
+		std::vector<std::vector<value>> parts((size + chunk - 1) / chunk);
+		if (!worker_pool::each(scope(), parts.size(), [&] (int c, state& ws)
+		{
+			state::scope chunk_scope(ws, scope.local);
+			return eval_items(parts[c], items, c * chunk, std::min(size, (c + 1) * chunk),
+				chunk_scope);
+		}))
+			return false;
+		
+		for (auto& p : parts)
+			output.insert(output.end(), p.begin(), p.end());
+	}
+	
+	if (output.size() == 0)
+		out = value::from_list(list::empty());
+	else
+		out = value::from_list(std::shared_ptr<list>(new list_basic(output)));
+	return true;
+}
+bool list_comp_expression::eval_items (std::vector<value>& output, list& items,
+		int first, int end, state::scope& scope)
+{
+	value item, filt_result;
+	
 	state::scope new_scope(scope.parent, // re-use this scope
 		std::shared_ptr<closure>(new closure(1, scope.local)));
 	
-	std::vector<value> output;
-	int size = list_val.list_obj->size();
-	for (int i = 0; i < size; i++)
+	for (int i = first; i < end; i++)
 	{
-		item = list_val.list_obj->get(i);
+		item = items.get(i);
 		new_scope.local->set(0, item); // set one argument, being the iterator
 		
 		if (filter != nullptr)
@@ -223,10 +503,6 @@ bool list_comp_expression::eval (value& out, state::scope& scope)
 		
 		output.push_back(item);
 	}
-	if (output.size() == 0)
-		out = value::from_list(list::empty());
-	else
-		out = value::from_list(std::shared_ptr<list>(new list_basic(output)));
 	return true;
 }
 bool list_comp_expression::locate_symbols (const std::shared_ptr<symbol_locator>& locator)
@@ -246,6 +522,14 @@ bool list_comp_expression::locate_symbols (const std::shared_ptr<symbol_locator>
 	return true;
 }
 bool list_comp_expression::constant () const { return false; }
+void list_comp_expression::children (child_list& same, child_list& inner)
+{
+	same.push_back(&start);
+	if (filter != nullptr)
+		inner.push_back(&filter);
+	if (map != nullptr)
+		inner.push_back(&map);
+}
 
 
 
@@ -257,13 +541,13 @@ bool list_comp_expression::constant () const { return false; }
 
 
 with_expression::with_expression ()
-	: closure_size(0)
+	: closure_size(0), cache_size(0)
 { }
 
 bool with_expression::eval_tail_call (tail_call& tc, value& out, state::scope& parent_scope)
 {
 	state::scope scope(parent_scope(),
-		std::shared_ptr<closure>(new closure(closure_size, parent_scope.local)));
+		std::shared_ptr<closure>(new closure(closure_size, parent_scope.local, cache_size)));
 	value item;
 	
 	int j, i = 0;
@@ -325,6 +609,14 @@ bool with_expression::locate_symbols (const std::shared_ptr<symbol_locator>& loc
 	return true;
 }
 bool with_expression::constant () const { return false; }
+void with_expression::children (child_list& same, child_list& inner)
+{
+	// the aliased values are evaluated in the new closure too
+	for (auto& v : vars)
+		inner.push_back(&v.val);
+	inner.push_back(&body);
+}
+int* with_expression::inner_cache_size () { return &cache_size; }
 
 bool with_expression::add (const std::string& name, const std::shared_ptr<expression>& val)
 {
@@ -380,6 +672,12 @@ bool map_expression::locate_symbols (const std::shared_ptr<symbol_locator>& loca
 	return true;
 }
 
+void map_expression::children (child_list& same, child_list& inner)
+{
+	for (auto& e : vals)
+		same.push_back(&e);
+}
+
 bool map_expression::add (const std::string& name, const std::shared_ptr<expression>& val)
 {
 	auto hash(map::get_hash(name));
@@ -419,6 +717,22 @@ bool map_access_expression::locate_symbols (const std::shared_ptr<symbol_locator
 {
 	return left->locate_symbols(locator);
 }
+void map_access_expression::children (child_list& same, child_list& inner)
+{
+	same.push_back(&left);
+}
+bool map_access_expression::equivalent (const expression& other) const
+{
+	auto o = dynamic_cast<const map_access_expression*>(&other);
+	return o != nullptr && o->key == key && left->equivalent(*o->left);
+}
+std::shared_ptr<expression> map_access_expression::inline_copy (const child_values& params, int slot_base)
+{
+	auto copy = left->inline_copy(params, slot_base);
+	if (copy == nullptr)
+		return nullptr;
+	return std::shared_ptr<expression>(new map_access_expression(keyname, copy));
+}
 
 
 
@@ -455,17 +769,68 @@ public:
 		return true;
 	}
 	virtual bool constant () const { return true; }
+	virtual bool is_list_literal () const { return val.type == value::type_list; }
+	virtual const value* const_value () const { return &val; }
+	
+	// lists and maps are only compared by identity here
+	virtual bool equivalent (const expression& other) const
+	{
+		auto v = other.const_value();
+		if (v == nullptr || v->type != val.type)
+			return false;
+		
+		switch (val.type)
+		{
+		case value::type_void:     return true;
+		case value::type_number:   return v->num == val.num;
+		case value::type_bool:     return v->cond == val.cond;
+		case value::type_string:   return v->str == val.str;
+		case value::type_function: return v->func_obj == val.func_obj;
+		case value::type_list:     return v->list_obj == val.list_obj;
+		case value::type_map:      return v->map_obj == val.map_obj;
+		default:                   return false;
+		}
+	}
+	
+	virtual std::shared_ptr<expression> inline_copy (const child_values& params, int slot_base)
+	{
+		return create_const(val);
+	}
+	
+	virtual void compile (bytecode& code, bool tail)
+	{
+		code.emit(bytecode::op_const, code.add_const(val));
+	}
+	
+	virtual bool compile_native (jit_builder& code, bool tail)
+	{
+		return code.constant(val);
+	}
+	
+	virtual bool emit_cpp (cpp_writer& code, std::string& result, bool tail)
+	{
+		return code.constant(result, val);
+	}
+	
+	virtual int infer (type_analysis& types, type_facts& facts)
+	{
+		return val.type;
+	}
 	
 private:
 	value val;
 };
+
+// larger constant lists are left to be built when used
+#define XY_FOLD_MAX_LIST 4096
+
 class binary_exp : public expression
 {
 public:
 	binary_exp (const std::shared_ptr<expression>& ea,
 					const std::shared_ptr<expression>& eb,
 					int opr)
-		: a(ea), b(eb), op(opr)
+		: a(ea), b(eb), op(opr), pure_literal(false)
 	{}
 	
 	virtual bool eval (value& out, state::scope& scope)
@@ -500,9 +865,61 @@ public:
 		return va.apply_operator(out, op, vb, scope());
 	}
 	
+	// the right operand of 'and' / 'or' is in tail position, and so is the
+	// call in '[x] + f(y)' or 'f(y) + [x]', modulo the pending concatenation.
+	// the latter evaluates its literal before the body of 'f', so only when
+	// the literal is pure (see expression::check_tail_concats)
+	virtual bool eval_tail_call (tail_call& tc, value& out, state::scope& scope)
+	{
+		if (op == '+' && tc.func != nullptr &&
+				a->is_list_literal() != b->is_list_literal() &&
+				(a->is_list_literal() || pure_literal))
+			return eval_tail_concat(tc, out, scope);
+		
+		if (op != lexer::token::keyword_and &&
+				op != lexer::token::keyword_or)
+		{
+			tc.do_tail = false;
+			return eval(out, scope);
+		}
+		
+		value va;
+		if (!a->eval(va, scope))
+			return false;
+		
+		bool cond = va.condition();
+		if (op == lexer::token::keyword_and)
+			cond = !cond;
+		
+		if (cond)
+		{
+			tc.do_tail = false;
+			out = va;
+			return true;
+		}
+		else
+			return b->eval_tail_call(tc, out, scope);
+	}
+	
+	// ranges are only built while loading when they are short, as their
+	// length is not bounded by the source
 	virtual bool constant () const
 	{
-		return a->constant() && b->constant();
+		if (!(a->constant() && b->constant()))
+			return false;
+		if (op != lexer::token::seq_token)
+			return true;
+		
+		auto va = a->const_value(), vb = b->const_value();
+		if (va == nullptr || vb == nullptr)
+			return false;
+		return !(va->is_type(value::type_number) && vb->is_type(value::type_number)) ||
+			vb->num - va->num < XY_FOLD_MAX_LIST;
+	}
+	
+	virtual bool is_list_literal () const
+	{
+		return op == '+' && a->is_list_literal() && b->is_list_literal();
 	}
 	
 	virtual bool locate_symbols (const std::shared_ptr<symbol_locator>& locator)
@@ -511,87 +928,393 @@ public:
 			b->locate_symbols(locator);
 	}
 	
-private:
-	std::shared_ptr<expression> a, b;
-	int op;
-};
-
-class unary_exp : public expression
-{
-public:
-	unary_exp (const std::shared_ptr<expression>& e,
-					int opr)
-		: a(e), op(opr)
-	{ }
-	
-	virtual bool eval (value& out, state::scope& scope)
+	virtual void children (child_list& same, child_list& inner)
 	{
-		value val;
-		if (!a->eval(val, scope))
-			return false;
-			
-		if (!val.apply_unary(out, op, scope()))
-			return false;
-		
-		return true;
+		same.push_back(&a);
+		same.push_back(&b);
 	}
 	
-	virtual bool constant () const
+	virtual bool equivalent (const expression& other) const
 	{
-		return a->constant();
+		auto o = dynamic_cast<const binary_exp*>(&other);
+		return o != nullptr && o->op == op &&
+			a->equivalent(*o->a) && b->equivalent(*o->b);
 	}
 	
-	virtual bool locate_symbols (const std::shared_ptr<symbol_locator>& locator)
+	virtual std::shared_ptr<expression> inline_copy (const child_values& params, int slot_base)
 	{
-		return a->locate_symbols(locator);
+		auto ca = a->inline_copy(params, slot_base);
+		auto cb = b->inline_copy(params, slot_base);
+		if (ca == nullptr || cb == nullptr)
+			return nullptr;
+		return create_binary(ca, cb, op);
 	}
 	
-private:
-	std::shared_ptr<expression> a;
-	int op;
-};
-
-
-class symbol_exp : public expression
-{
-public:
-	symbol_exp (const std::string& s)
-		: type( unresolved), sym(s)
-	{ }
-	
-	symbol_exp (int index, int depth)
-		: type(resolved_local), closure_index(index), closure_depth(depth)
-	{ }
-	
-	virtual bool eval (value& out, state::scope& scope)
+	// the right operand of 'and' / 'or' is only evaluated if needed. in
+	// '[x] + f(y)' the literal waits in the frame while the call replaces
+	// it; 'f(y) + [x]' evaluates its literal after the arguments, which is
+	// left to the tree interpreter
+	virtual void compile (bytecode& code, bool tail)
 	{
-		switch (type)
+		if (tail && op == '+' && a->is_list_literal() != b->is_list_literal())
 		{
-		case resolved_local:
-			out = scope.local->get(closure_index, closure_depth);
-			return true;
-			
-		case resolved_global:
+			if (!a->is_list_literal())
 			{
-				auto func = scope().global().find_function(sym);
-				if (func == nullptr) // this shouldn't happen ever
-					out.type = value::type_void;
-				else
-					out = value::from_function(func);
-				return true;
+				expression::compile(code, tail);
+				return;
 			}
-			
-		default:
-			scope().error().die()
-				<< "Use of unresolved symbol '" << sym << "'";
-			return false;
+			a->compile(code, false);
+			code.emit(bytecode::op_pend);
+			b->compile(code, true);
+			return;
 		}
-	}
-	
-	virtual bool locate_symbols (const std::shared_ptr<symbol_locator>& locator)
-	{
-		if (type != unresolved)
-			return true;
+		
+		a->compile(code, false);
+		
+		if (op == lexer::token::keyword_and ||
+				op == lexer::token::keyword_or)
+		{
+			int jump = code.emit(op == lexer::token::keyword_and ?
+				bytecode::op_and : bytecode::op_or);
+			b->compile(code, tail);
+			code.patch(jump);
+		}
+		else
+		{
+			b->compile(code, false);
+			code.emit(bytecode::op_binary, op);
+		}
+	}
+	
+	virtual bool compile_native (jit_builder& code, bool tail)
+	{
+		return code.binary(op, *a, *b, tail);
+	}
+	
+	virtual bool emit_cpp (cpp_writer& code, std::string& result, bool tail)
+	{
+		return code.binary(result, op, *a, *b, tail);
+	}
+	
+	virtual int infer (type_analysis& types, type_facts& facts)
+	{
+		int ta = types.visit(*a, facts);
+		
+		if (op == lexer::token::keyword_and ||
+				op == lexer::token::keyword_or)
+		{
+			type_facts rest(facts);
+			if (op == lexer::token::keyword_and)
+				a->assume_true(rest);
+			return type_analysis::join(ta, types.visit(*b, rest));
+		}
+		
+		int tb = types.visit(*b, facts);
+		if (ta == type_analysis::type_none || tb == type_analysis::type_none)
+			return type_analysis::type_none;
+		
+		switch (op)
+		{
+		// these fail unless both operands have the same orderable type
+		case '<': case '>':
+		case lexer::token::gre_token:
+		case lexer::token::lse_token:
+			if (ta == value::type_any && orderable(tb))
+				a->assume_type(facts, (value::value_type)tb);
+			if (tb == value::type_any && orderable(ta))
+				b->assume_type(facts, (value::value_type)ta);
+			return value::type_bool;
+		
+		case lexer::token::eql_token:
+		case lexer::token::neq_token:
+			return value::type_bool;
+		
+		case '+':
+			if (ta == value::type_void)
+				return tb;
+			if (ta == value::type_string ||
+					(ta == tb && (ta == value::type_number || ta == value::type_list ||
+					              ta == value::type_map)))
+				return ta;
+			return value::type_any;
+		
+		case '-': case '*': case '/': case '%': case '^':
+			if (ta == value::type_number && tb == value::type_number)
+				return value::type_number;
+			return value::type_any;
+		
+		default:
+			return value::type_any;
+		}
+	}
+	
+	// values only compare equal to values of the same type
+	virtual void assume_true (type_facts& facts)
+	{
+		if (op == lexer::token::keyword_and)
+		{
+			a->assume_true(facts);
+			b->assume_true(facts);
+		}
+		else if (op == lexer::token::eql_token)
+		{
+			if (auto c = b->const_value())
+				a->assume_type(facts, c->type);
+			else if (auto c = a->const_value())
+				b->assume_type(facts, c->type);
+		}
+	}
+	
+	inline int operator_token () const { return op; }
+	inline void set_pure_literal (bool p) { pure_literal = p; }
+	
+protected:
+	std::shared_ptr<expression> a, b;
+	int op;
+	bool pure_literal;
+	
+private:
+	static bool orderable (int t)
+	{
+		return t == value::type_number || t == value::type_string;
+	}
+	
+	bool eval_tail_concat (tail_call& tc, value& out, state::scope& scope)
+	{
+		bool left = a->is_list_literal();
+		value lit, other;
+		
+		// reserve our place first so that pending operands stay in
+		// nesting order; the literal itself is evaluated in its usual order
+		int slot = tc.pending.size();
+		tc.pending.push_back({ value(), left });
+		
+		if (left && !a->eval(lit, scope))
+			return false;
+		
+		if (!(left ? b : a)->eval_tail_call(tc, other, scope))
+			return false;
+		
+		if (!left && !b->eval(lit, scope))
+			return false;
+		
+		if (tc.do_tail)
+		{
+			tc.pending[slot].val = lit;
+			return true;
+		}
+		
+		tc.pending.resize(slot);
+		if (left)
+			return lit.apply_operator(out, op, other, scope());
+		else
+			return other.apply_operator(out, op, lit, scope());
+	}
+};
+
+class unary_exp : public expression
+{
+public:
+	unary_exp (const std::shared_ptr<expression>& e,
+					int opr)
+		: a(e), op(opr)
+	{ }
+	
+	virtual bool eval (value& out, state::scope& scope)
+	{
+		value val;
+		if (!a->eval(val, scope))
+			return false;
+			
+		if (!val.apply_unary(out, op, scope()))
+			return false;
+		
+		return true;
+	}
+	
+	virtual bool constant () const
+	{
+		return a->constant();
+	}
+	
+	virtual bool locate_symbols (const std::shared_ptr<symbol_locator>& locator)
+	{
+		return a->locate_symbols(locator);
+	}
+	
+	virtual void children (child_list& same, child_list& inner)
+	{
+		same.push_back(&a);
+	}
+	
+	virtual bool equivalent (const expression& other) const
+	{
+		auto o = dynamic_cast<const unary_exp*>(&other);
+		return o != nullptr && o->op == op && a->equivalent(*o->a);
+	}
+	
+	virtual std::shared_ptr<expression> inline_copy (const child_values& params, int slot_base)
+	{
+		auto ca = a->inline_copy(params, slot_base);
+		if (ca == nullptr)
+			return nullptr;
+		return create_unary(ca, op);
+	}
+	
+	virtual void compile (bytecode& code, bool tail)
+	{
+		a->compile(code, false);
+		code.emit(bytecode::op_unary, op);
+	}
+	
+	virtual bool compile_native (jit_builder& code, bool tail)
+	{
+		return code.unary(op, *a);
+	}
+	
+	virtual bool emit_cpp (cpp_writer& code, std::string& result, bool tail)
+	{
+		return code.unary(result, op, *a);
+	}
+	
+	virtual int infer (type_analysis& types, type_facts& facts)
+	{
+		if (types.visit(*a, facts) == type_analysis::type_none)
+			return type_analysis::type_none;
+		
+		switch (op)
+		{
+		case '-': // fails on anything else
+			a->assume_type(facts, value::type_number);
+			return value::type_number;
+		case '!':
+			return value::type_bool;
+		default:
+			return value::type_any;
+		}
+	}
+	
+private:
+	std::shared_ptr<expression> a;
+	int op;
+};
+
+
+class symbol_exp : public expression
+{
+public:
+	symbol_exp (const std::string& s)
+		: type( unresolved), sym(s)
+	{ }
+	
+	symbol_exp (int index, int depth)
+		: type(resolved_local), closure_index(index), closure_depth(depth)
+	{ }
+	
+	virtual bool eval (value& out, state::scope& scope)
+	{
+		switch (type)
+		{
+		case resolved_local:
+			out = scope.local->get(closure_index, closure_depth);
+			return true;
+			
+		case resolved_global:
+			{
+				auto func = scope().global().find_function(sym);
+				if (func == nullptr) // this shouldn't happen ever
+					out.type = value::type_void;
+				else
+					out = value::from_function(func);
+				return true;
+			}
+			
+		default:
+			scope().error().die()
+				<< "Use of unresolved symbol '" << sym << "'";
+			return false;
+		}
+	}
+	
+	// global functions cannot change once the environment is loaded
+	virtual bool constant () const
+	{
+		return type == resolved_global;
+	}
+	
+	virtual bool equivalent (const expression& other) const
+	{
+		auto o = dynamic_cast<const symbol_exp*>(&other);
+		if (o == nullptr || o->type != type)
+			return false;
+		
+		switch (type)
+		{
+		case resolved_local:
+			return o->closure_index == closure_index &&
+				o->closure_depth == closure_depth;
+		case resolved_global:
+			return o->sym == sym;
+		default:
+			return false;
+		}
+	}
+	
+	inline bool is_local () const { return type == resolved_local; }
+	inline int index () const { return closure_index; }
+	inline int depth () const { return closure_depth; }
+	
+	// inlined bodies have no nested scopes, so locals are all parameters
+	virtual std::shared_ptr<expression> inline_copy (const child_values& params, int slot_base)
+	{
+		if (type == resolved_global)
+			return std::shared_ptr<expression>(new symbol_exp(*this));
+		else if (type == resolved_local && closure_depth == 0 &&
+				closure_index < (int)params.size())
+			return params[closure_index];
+		else
+			return nullptr;
+	}
+	
+	virtual void compile (bytecode& code, bool tail)
+	{
+		if (type == resolved_local)
+			code.emit(bytecode::op_local, closure_index, closure_depth);
+		else
+			expression::compile(code, tail);
+	}
+	
+	virtual bool compile_native (jit_builder& code, bool tail)
+	{
+		return type == resolved_local &&
+			code.local(closure_index, closure_depth);
+	}
+	
+	virtual bool emit_cpp (cpp_writer& code, std::string& result, bool tail)
+	{
+		return type == resolved_local &&
+			code.local(result, closure_index, closure_depth);
+	}
+	
+	virtual int infer (type_analysis& types, type_facts& facts)
+	{
+		if (type == resolved_global)
+			return value::type_function;
+		if (type == resolved_local && closure_depth == 0)
+			return facts.local(closure_index);
+		return value::type_any;
+	}
+	
+	virtual void assume_type (type_facts& facts, value::value_type t)
+	{
+		if (type == resolved_local && closure_depth == 0)
+			facts.set_local(closure_index, t);
+	}
+	
+	virtual bool locate_symbols (const std::shared_ptr<symbol_locator>& locator)
+	{
+		if (type != unresolved)
+			return true;
 		
 		if (locator->locate(sym, closure_index, closure_depth))
 			type = resolved_local;
@@ -601,17 +1324,1362 @@ public:
 		return true;
 	}
 	
-private:
-	enum resolve_type
+private:
+	enum resolve_type
+	{
+		unresolved,
+		resolved_global,
+		resolved_local
+	};
+	resolve_type type;
+	std::string sym;
+	int closure_index, closure_depth;
+};
+
+// operators on two numbers, as computed by value::apply_operator; false
+// when the result is left to it (division by zero)
+template <int Op>
+static inline bool number_operator (value& out, number x, number y)
+{
+	switch (Op)
+	{
+	case '+': out = value::from_number(x + y); return true;
+	case '-': out = value::from_number(x - y); return true;
+	case '*': out = value::from_number(x * y); return true;
+	case '^': out = value::from_number(pow(x, y)); return true;
+	case '/':
+		if (y == 0)
+			return false;
+		out = value::from_number(x / y);
+		return true;
+	case '%':
+		if (y == 0)
+			return false;
+		out = value::from_number(x - (int)(x / y) * y);
+		return true;
+	
+	case lexer::token::eql_token: out = value::from_bool(x == y); return true;
+	case '>':                     out = value::from_bool(x > y); return true;
+	case '<':                     out = value::from_bool(!(x == y || x > y)); return true;
+	case lexer::token::gre_token: out = value::from_bool(x == y || x > y); return true;
+	case lexer::token::lse_token: out = value::from_bool(!(x > y)); return true;
+	default:                      return false;
+	}
+}
+
+// a binary operator that takes a shortcut for numbers until it first sees
+// other operands, after which it stays on the generic path
+template <int Op>
+class number_binary_exp : public binary_exp
+{
+public:
+	number_binary_exp (const std::shared_ptr<expression>& ea,
+					const std::shared_ptr<expression>& eb)
+		: binary_exp(ea, eb, Op), generic(false)
+	{ }
+	
+	virtual bool eval (value& out, state::scope& scope)
+	{
+		if (generic.load(std::memory_order_relaxed))
+			return binary_exp::eval(out, scope);
+		
+		value va, vb;
+		if (!a->eval(va, scope) || !b->eval(vb, scope))
+			return false;
+		
+		if (va.type == value::type_number && vb.type == value::type_number)
+		{
+			if (number_operator<Op>(out, va.num, vb.num))
+				return true;
+		}
+		else
+			generic.store(true, std::memory_order_relaxed);
+		
+		return va.apply_operator(out, Op, vb, scope());
+	}
+	
+	virtual std::shared_ptr<expression> specialize ();
+	
+protected:
+	std::atomic<bool> generic; // set by any thread
+};
+
+// 'x op c' where 'x' is a local and 'c' a number, as in 'n - 1', 'n < 0' or
+// the '==' conditions of constant parameters
+template <int Op>
+class local_number_exp : public number_binary_exp<Op>
+{
+public:
+	local_number_exp (const std::shared_ptr<expression>& ea,
+					const std::shared_ptr<expression>& eb,
+					int index, int depth, number n)
+		: number_binary_exp<Op>(ea, eb),
+		  closure_index(index), closure_depth(depth), num(n)
+	{ }
+	
+	virtual bool eval (value& out, state::scope& scope)
+	{
+		value va = scope.local->get(closure_index, closure_depth);
+		if (va.type == value::type_number &&
+				number_operator<Op>(out, va.num, num))
+			return true;
+		
+		return va.apply_operator(out, Op, value::from_number(num), scope());
+	}
+	
+	virtual std::shared_ptr<expression> specialize ();
+	
+protected:
+	int closure_index, closure_depth;
+	number num;
+};
+
+// both operands are proven to be numbers (see type_analysis), which leaves
+// only division by zero to the generic path
+template <int Op>
+class typed_local_exp : public local_number_exp<Op>
+{
+public:
+	typed_local_exp (const std::shared_ptr<expression>& ea,
+					const std::shared_ptr<expression>& eb,
+					int index, int depth, number n)
+		: local_number_exp<Op>(ea, eb, index, depth, n)
+	{ }
+	
+	virtual bool eval (value& out, state::scope& scope)
+	{
+		value va = scope.local->get(this->closure_index, this->closure_depth);
+		if (number_operator<Op>(out, va.num, this->num))
+			return true;
+		
+		return va.apply_operator(out, Op, value::from_number(this->num), scope());
+	}
+	
+	virtual std::shared_ptr<expression> specialize () { return nullptr; }
+};
+
+template <int Op>
+std::shared_ptr<expression> local_number_exp<Op>::specialize ()
+{
+	if (this->a->proven_type() != value::type_number)
+		return nullptr;
+	return std::shared_ptr<expression>(new typed_local_exp<Op>(this->a, this->b,
+		closure_index, closure_depth, num));
+}
+
+template <int Op>
+class typed_number_exp : public number_binary_exp<Op>
+{
+public:
+	typed_number_exp (const std::shared_ptr<expression>& ea,
+					const std::shared_ptr<expression>& eb)
+		: number_binary_exp<Op>(ea, eb)
+	{ }
+	
+	virtual bool eval (value& out, state::scope& scope)
+	{
+		value va, vb;
+		if (!this->a->eval(va, scope) || !this->b->eval(vb, scope))
+			return false;
+		
+		if (number_operator<Op>(out, va.num, vb.num))
+			return true;
+		return va.apply_operator(out, Op, vb, scope());
+	}
+	
+	virtual std::shared_ptr<expression> specialize () { return nullptr; }
+};
+
+template <int Op>
+std::shared_ptr<expression> number_binary_exp<Op>::specialize ()
+{
+	if (a->proven_type() == value::type_number &&
+			b->proven_type() == value::type_number)
+		return std::shared_ptr<expression>(new typed_number_exp<Op>(a, b));
+	
+	auto sym = dynamic_cast<symbol_exp*>(a.get());
+	auto c = b->const_value();
+	if (sym == nullptr || !sym->is_local() ||
+			c == nullptr || c->type != value::type_number)
+		return nullptr;
+	
+	return std::shared_ptr<expression>(new local_number_exp<Op>(a, b,
+		sym->index(), sym->depth(), c->num));
+}
+
+
+
+// one occurrence of a common subexpression; whichever occurrence is
+// evaluated first stores its value in the closure's hidden slot
+class cached_exp : public expression
+{
+public:
+	cached_exp (int s, const std::shared_ptr<expression>& ex)
+		: slot(s), e(ex)
+	{ }
+	
+	virtual bool eval (value& out, state::scope& scope)
+	{
+		if (scope.local->cached(slot, out))
+			return true;
+		
+		if (!e->eval(out, scope))
+			return false;
+		
+		scope.local->cache(slot, out);
+		return true;
+	}
+	
+	virtual bool locate_symbols (const std::shared_ptr<symbol_locator>& locator)
+	{
+		return e->locate_symbols(locator);
+	}
+	
+	virtual void children (child_list& same, child_list& inner)
+	{
+		same.push_back(&e);
+	}
+	
+	virtual bool equivalent (const expression& other) const
+	{
+		auto o = dynamic_cast<const cached_exp*>(&other);
+		return o != nullptr && o->slot == slot;
+	}
+	
+	virtual void compile (bytecode& code, bool tail)
+	{
+		int jump = code.emit(bytecode::op_cached, slot);
+		e->compile(code, false);
+		code.emit(bytecode::op_cache, slot);
+		code.patch(jump);
+	}
+	
+	virtual bool compile_native (jit_builder& code, bool tail)
+	{
+		return code.cached(slot, *e);
+	}
+	
+	virtual bool emit_cpp (cpp_writer& code, std::string& result, bool tail)
+	{
+		return code.cached(result, slot, *e);
+	}
+	
+	// 'e' is evaluated at the first occurrence only, which need not be this
+	virtual int infer (type_analysis& types, type_facts& facts)
+	{
+		type_facts maybe(facts);
+		return types.visit(*e, maybe);
+	}
+	
+private:
+	int slot;
+	std::shared_ptr<expression> e;
+};
+
+// a loop invariant (see expression::hoist_invariants); only the tree
+// interpreter keeps its value, the other engines evaluate 'e' in place
+class invariant_exp : public expression
+{
+public:
+	invariant_exp (int s, const std::shared_ptr<expression>& ex)
+		: slot(s), e(ex)
+	{
+		proven = e->proven_type();
+	}
+	
+	virtual bool eval (value& out, state::scope& scope)
+	{
+		if (scope.local->invariant(slot, out))
+			return true;
+		
+		if (!e->eval(out, scope))
+			return false;
+		
+		scope.local->set_invariant(slot, out);
+		return true;
+	}
+	
+	virtual void children (child_list& same, child_list& inner)
+	{
+		same.push_back(&e);
+	}
+	
+	virtual bool equivalent (const expression& other) const
+	{
+		auto o = dynamic_cast<const invariant_exp*>(&other);
+		return o != nullptr && o->slot == slot;
+	}
+	
+	// the slots belong to the function hoisted from
+	virtual std::shared_ptr<expression> inline_copy (const child_values& params, int slot_base)
+	{
+		return e->inline_copy(params, slot_base);
+	}
+	
+	virtual void compile (bytecode& code, bool tail)
+	{
+		e->compile(code, false);
+	}
+	
+	virtual bool compile_native (jit_builder& code, bool tail)
+	{
+		return e->compile_native(code, false);
+	}
+	
+	virtual bool emit_cpp (cpp_writer& code, std::string& result, bool tail)
+	{
+		return e->emit_cpp(code, result, false);
+	}
+	
+	virtual int infer (type_analysis& types, type_facts& facts)
+	{
+		return types.visit(*e, facts);
+	}
+	
+private:
+	int slot;
+	std::shared_ptr<expression> e;
+};
+
+
+
+
+
+// a parameter of an inlined call
+class slot_exp : public expression
+{
+public:
+	slot_exp (int s)
+		: slot(s)
+	{ }
+	
+	virtual bool eval (value& out, state::scope& scope)
+	{
+		out = scope.local->slot(slot);
+		return true;
+	}
+	
+	virtual bool locate_symbols (const std::shared_ptr<symbol_locator>& locator)
+	{
+		return true;
+	}
+	
+	virtual bool equivalent (const expression& other) const
+	{
+		auto o = dynamic_cast<const slot_exp*>(&other);
+		return o != nullptr && o->slot == slot;
+	}
+	
+	virtual std::shared_ptr<expression> inline_copy (const child_values& params, int slot_base)
+	{
+		return std::shared_ptr<expression>(new slot_exp(slot + slot_base));
+	}
+	
+	virtual void compile (bytecode& code, bool tail)
+	{
+		code.emit(bytecode::op_slot, slot);
+	}
+	
+	virtual bool compile_native (jit_builder& code, bool tail)
+	{
+		return code.slot(slot);
+	}
+	
+	virtual bool emit_cpp (cpp_writer& code, std::string& result, bool tail)
+	{
+		return code.slot(result, slot);
+	}
+	
+	virtual int infer (type_analysis& types, type_facts& facts)
+	{
+		return facts.slot(slot);
+	}
+	
+	virtual void assume_type (type_facts& facts, value::value_type t)
+	{
+		facts.set_slot(slot, t);
+	}
+	
+private:
+	int slot;
+};
+
+// the body of an inlined call, evaluated after storing its non-constant
+// arguments in hidden slots of the caller's closure
+class inline_exp : public expression
+{
+public:
+	virtual bool eval (value& out, state::scope& scope)
+	{
+		return bind(scope) && body->eval(out, scope);
+	}
+	
+	virtual bool eval_tail_call (tail_call& tc, value& out, state::scope& scope)
+	{
+		return bind(scope) && body->eval_tail_call(tc, out, scope);
+	}
+	
+	virtual bool is_list_literal () const
+	{
+		return body->is_list_literal();
+	}
+	
+	virtual bool locate_symbols (const std::shared_ptr<symbol_locator>& locator)
+	{
+		return true;
+	}
+	
+	virtual void children (child_list& same, child_list& inner)
+	{
+		for (auto& a : args)
+			same.push_back(&a.val);
+		same.push_back(&body);
+	}
+	
+	virtual std::shared_ptr<expression> inline_copy (const child_values& params, int slot_base)
+	{
+		std::shared_ptr<inline_exp> copy(new inline_exp());
+		for (auto& a : args)
+		{
+			auto val = a.val->inline_copy(params, slot_base);
+			if (val == nullptr)
+				return nullptr;
+			copy->add(a.slot + slot_base, val);
+		}
+		
+		copy->body = body->inline_copy(params, slot_base);
+		if (copy->body == nullptr)
+			return nullptr;
+		return copy;
+	}
+	
+	virtual void compile (bytecode& code, bool tail)
+	{
+		for (auto& a : args)
+		{
+			a.val->compile(code, false);
+			code.emit(bytecode::op_set_slot, a.slot);
+		}
+		body->compile(code, tail);
+	}
+	
+	virtual bool compile_native (jit_builder& code, bool tail)
+	{
+		for (auto& a : args)
+			if (!code.bind_slot(a.slot, *a.val))
+				return false;
+		return body->compile_native(code, tail);
+	}
+	
+	virtual bool emit_cpp (cpp_writer& code, std::string& result, bool tail)
+	{
+		for (auto& a : args)
+			if (!code.bind_slot(a.slot, *a.val))
+				return false;
+		return body->emit_cpp(code, result, tail);
+	}
+	
+	virtual int infer (type_analysis& types, type_facts& facts)
+	{
+		for (auto& a : args)
+		{
+			int t = types.visit(*a.val, facts);
+			if (t == type_analysis::type_none)
+				return t;
+			facts.set_slot(a.slot, (value::value_type)t);
+		}
+		return types.visit(*body, facts);
+	}
+	
+	inline void add (int slot, const std::shared_ptr<expression>& val)
+	{
+		args.push_back({ slot, val });
+	}
+	inline void set_body (const std::shared_ptr<expression>& e) { body = e; }
+	
+private:
+	struct argument
+	{
+		int slot;
+		std::shared_ptr<expression> val;
+	};
+	std::vector<argument> args;
+	std::shared_ptr<expression> body;
+	
+	inline bool bind (state::scope& scope)
+	{
+		for (auto& a : args)
+			if (!a.val->eval(scope.local->slot(a.slot), scope))
+				return false;
+		return true;
+	}
+};
+
+
+
+
+
+bool purity_analysis::pure (expression* e)
+{
+	if (!locally_pure(e))
+		return false;
+	
+	child_list same, inner;
+	e->children(same, inner);
+	for (auto c : same)
+		if (!pure(c->get()))
+			return false;
+	for (auto c : inner)
+		if (!pure(c->get()))
+			return false;
+	return true;
+}
+
+bool purity_analysis::locally_pure (expression* e)
+{
+	auto call = dynamic_cast<call_expression*>(e);
+	if (call == nullptr)
+		return true;
+	
+	auto callee = call->callee().get();
+	auto f = callee->const_value();
+	
+	if (f == nullptr)
+	{
+		// 'a(b)(c)' multiplies if 'a' is a number; other callees are unknown
+		auto inner = dynamic_cast<call_expression*>(callee);
+		return inner != nullptr && locally_pure(inner) &&
+			inner->callee()->const_value() != nullptr &&
+			inner->callee()->const_value()->type == value::type_number;
+	}
+	
+	if (!pure_function(f))
+		return false;
+	
+	// higher order natives call some of their arguments, like the first
+	// one, and the handler of 'try'; those must be known pure functions
+	if (f->type == value::type_function &&
+			f->func_obj->purity() == function::purity_higher_order)
+	{
+		auto& args = call->arguments();
+		for (size_t i = 0; i < args.size(); i++)
+		{
+			std::vector<std::shared_ptr<func_body>> bodies;
+			args[i]->function_bodies(bodies);
+			
+			if (args[i]->const_value() != nullptr)
+			{
+				if (!pure_function(args[i]->const_value()))
+					return false;
+			}
+			else if (f->func_obj->calls_argument(i) && bodies.size() == 0)
+				return false;
+			// lambdas are checked along with the children
+		}
+	}
+	return true;
+}
+
+bool purity_analysis::pure_function (const value* v)
+{
+	if (v->type != value::type_function)
+		return true;
+	
+	auto f = v->func_obj.get();
+	if (f->is_native())
+		return f->purity() != function::purity_impure;
+	
+	analyze(f);
+	return impure.count(f) == 0;
+}
+
+static void collect_functions (expression* e, std::vector<function*>& out)
+{
+	auto v = e->const_value();
+	if (v != nullptr && v->type == value::type_function && !v->func_obj->is_native())
+		out.push_back(v->func_obj.get());
+	
+	child_list same, inner;
+	e->children(same, inner);
+	for (auto c : same)
+		collect_functions(c->get(), out);
+	for (auto c : inner)
+		collect_functions(c->get(), out);
+}
+
+static void body_expressions (const std::shared_ptr<func_body>& b, std::vector<expression*>& out)
+{
+	for (int i = 0; i < b->params.size(); i++)
+		if (b->params.condition(i) != nullptr)
+			out.push_back(b->params.condition(i).get());
+	out.push_back(b->body.get());
+}
+
+static bool all_locally_pure (expression* e, std::function<bool(expression*)> test)
+{
+	if (!test(e))
+		return false;
+	
+	child_list same, inner;
+	e->children(same, inner);
+	for (auto c : same)
+		if (!all_locally_pure(c->get(), test))
+			return false;
+	for (auto c : inner)
+		if (!all_locally_pure(c->get(), test))
+			return false;
+	return true;
+}
+
+void purity_analysis::analyze (function* f)
+{
+	if (analyzed.count(f) > 0)
+		return;
+	
+	// every soft function reachable from 'f' is analyzed together
+	std::vector<function*> fresh, work { f };
+	while (work.size() > 0)
+	{
+		auto g = work.back();
+		work.pop_back();
+		if (analyzed.count(g) > 0)
+			continue;
+		
+		analyzed.insert(g);
+		fresh.push_back(g);
+		
+		std::vector<expression*> exps;
+		for (auto& b : static_cast<soft_function*>(g)->bodies())
+			body_expressions(b, exps);
+		for (auto e : exps)
+			collect_functions(e, work);
+	}
+	
+	// assume all are pure, then mark impure ones until nothing changes
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+		for (auto g : fresh)
+		{
+			if (impure.count(g) > 0)
+				continue;
+			
+			std::vector<expression*> exps;
+			for (auto& b : static_cast<soft_function*>(g)->bodies())
+				body_expressions(b, exps);
+			
+			for (auto e : exps)
+				if (!all_locally_pure(e, [this] (expression* x) { return locally_pure(x); }))
+				{
+					impure.insert(g);
+					changed = true;
+					break;
+				}
+		}
+	}
+}
+
+
+
+value::value_type type_facts::local (int index) const
+{
+	return index >= 0 && index < (int)locals.size() ? locals[index] : value::type_any;
+}
+value::value_type type_facts::slot (int s) const
+{
+	return s >= 0 && s < (int)slots.size() ? slots[s] : value::type_any;
+}
+void type_facts::set_local (int index, value::value_type t)
+{
+	if (index >= (int)locals.size())
+		locals.resize(index + 1, value::type_any);
+	locals[index] = t;
+}
+void type_facts::set_slot (int s, value::value_type t)
+{
+	if (s >= (int)slots.size())
+		slots.resize(s + 1, value::type_any);
+	slots[s] = t;
+}
+
+
+int type_analysis::join (int a, int b)
+{
+	if (a == type_none || a == b)
+		return b;
+	if (b == type_none)
+		return a;
+	return value::type_any;
+}
+
+int type_analysis::visit (expression& e, type_facts& facts)
+{
+	int t = e.infer(*this, facts);
+	auto type = t == type_none ? value::type_any : (value::value_type)t;
+	if (!counting)
+	{
+		e.proven = type;
+		return t;
+	}
+	
+	// nodes shared by common subexpressions keep only what holds for all
+	auto it = seen.find(&e);
+	if (it != seen.end())
+	{
+		if (it->second != type)
+			it->second = e.proven = value::type_any;
+		return t;
+	}
+	seen[&e] = e.proven = type;
+	return t;
+}
+
+// the guards hold before the body is evaluated
+int type_analysis::body (func_body& b, const type_facts& given)
+{
+	type_facts facts(given);
+	for (int i = 0; i < b.params.size(); i++)
+		if (auto& cond = b.params.condition(i))
+		{
+			visit(*cond, facts);
+			cond->assume_true(facts);
+		}
+	return visit(*b.body, facts);
+}
+
+int type_analysis::result (function* f)
+{
+	if (!closed && !f->is_native() && !f->is_lambda())
+		return value::type_any;
+	
+	auto it = results.find(f);
+	return it != results.end() ? it->second : f->result_type();
+}
+
+void type_analysis::run (environment& env)
+{
+	std::vector<soft_function*> funcs;
+	results.clear();
+	for (auto& f : env.functions())
+		if (!f->is_native())
+		{
+			funcs.push_back(static_cast<soft_function*>(f.get()));
+			results[f.get()] = type_none;
+		}
+	
+	// each result changes at most twice, from 'none' to a type to any
+	counting = false;
+	for (int round = 0, changed = 1; changed && round <= 2 * (int)funcs.size(); round++)
+	{
+		changed = 0;
+		for (auto f : funcs)
+		{
+			int t = type_none;
+			for (auto& b : f->bodies())
+				t = join(t, body(*b));
+			
+			if (t != results[f])
+			{
+				results[f] = t;
+				changed = 1;
+			}
+		}
+	}
+	
+	// once more, so that every node is typed with the final results
+	counting = true;
+	seen.clear();
+	for (auto f : funcs)
+		for (auto& b : f->bodies())
+			body(*b);
+	counting = false;
+	
+	nodes = seen.size();
+	proven = 0;
+	for (auto& n : seen)
+		if (n.second != value::type_any)
+			proven++;
+	
+	for (auto f : funcs)
+		f->set_result_type(results[f] == type_none ? value::type_any :
+			(value::value_type)results[f]);
+}
+
+
+
+// common subexpressions are searched among at most this many nodes
+#define XY_CSE_MAX_NODES 1000
+
+static int tree_size (expression* e)
+{
+	child_list same, inner;
+	e->children(same, inner);
+	int size = 1;
+	for (auto c : same)
+		size += tree_size(c->get());
+	for (auto c : inner)
+		size += tree_size(c->get());
+	return size;
+}
+
+// the nodes evaluated in the same closure as 'e'; the copies inside
+// cached nodes are not separate occurrences
+static void scope_nodes (std::shared_ptr<expression>* e, child_list& out)
+{
+	out.push_back(e);
+	if (dynamic_cast<cached_exp*>(e->get()) != nullptr)
+		return;
+	
+	child_list same, inner;
+	(*e)->children(same, inner);
+	for (auto c : same)
+		scope_nodes(c, out);
+}
+
+typedef std::function<void(child_list&, int&)> scope_pass;
+static void each_body (func_body& body, const scope_pass& pass);
+
+// runs 'pass' on every scope nested in 'roots', innermost first, and then
+// on 'roots' themselves; 'slots' counts the hidden slots of the scope's
+// closure, and is negative if the closure is re-used between evaluations
+// (list comprehensions)
+static void each_scope (child_list& roots, int& slots, const scope_pass& pass)
+{
+	child_list nodes;
+	for (auto r : roots)
+		scope_nodes(r, nodes);
+	
+	for (auto n : nodes)
+	{
+		child_list same, inner;
+		(*n)->children(same, inner);
+		if (inner.size() == 0)
+			continue;
+		
+		std::vector<std::shared_ptr<func_body>> bodies;
+		(*n)->function_bodies(bodies);
+		
+		if (int* size = (*n)->inner_cache_size())
+			each_scope(inner, *size, pass);
+		else if (bodies.size() > 0)
+			for (auto& b : bodies)
+				each_body(*b, pass);
+		else
+		{
+			int reused = -1;
+			each_scope(inner, reused, pass);
+		}
+	}
+	
+	pass(roots, slots);
+}
+
+static void each_body (func_body& body, const scope_pass& pass)
+{
+	child_list roots;
+	for (int i = 0; i < body.params.size(); i++)
+		if (body.params.condition(i) != nullptr)
+			roots.push_back(&body.params.condition(i));
+	roots.push_back(&body.body);
+	
+	each_scope(roots, body.cache_size, pass);
+}
+
+static void share_common (child_list& roots, int& cache_size, purity_analysis& pure)
+{
+	child_list nodes;
+	for (auto r : roots)
+		scope_nodes(r, nodes);
+	
+	if (cache_size < 0 || nodes.size() > XY_CSE_MAX_NODES)
+		return;
+	
+	for (;;)
+	{
+		nodes.clear();
+		for (auto r : roots)
+			scope_nodes(r, nodes);
+		
+		child_list candidates;
+		for (auto n : nodes)
+		{
+			auto e = n->get();
+			child_list same, inner;
+			std::vector<std::shared_ptr<func_body>> bodies;
+			e->children(same, inner);
+			e->function_bodies(bodies);
+			
+			// leave out constants, symbols, cached nodes and lambdas
+			if ((same.size() == 0 && inner.size() == 0) || bodies.size() > 0 ||
+					dynamic_cast<cached_exp*>(e) != nullptr)
+				continue;
+			
+			if (pure.pure(e))
+				candidates.push_back(n);
+		}
+		
+		// the biggest expression with more than one occurrence
+		int best = -1, best_size = 0;
+		for (int i = 0, count = candidates.size(); i < count; i++)
+		{
+			int size = tree_size(candidates[i]->get());
+			if (size <= best_size)
+				continue;
+			
+			for (int j = i + 1; j < count; j++)
+				if ((*candidates[i])->equivalent(**candidates[j]))
+				{
+					best = i;
+					best_size = size;
+					break;
+				}
+		}
+		if (best < 0)
+			break;
+		
+		int slot = cache_size++;
+		auto e = *candidates[best];
+		for (auto c : candidates)
+			if (c == candidates[best] || e->equivalent(**c))
+				*c = expression::create_cached(slot, *c);
+	}
+}
+
+void expression::eliminate_common (func_body& body, purity_analysis& pure)
+{
+	each_body(body, [&] (child_list& roots, int& slots) {
+		share_common(roots, slots, pure);
+	});
+}
+
+static void check_concats (expression* e, purity_analysis& pure)
+{
+	auto bin = dynamic_cast<binary_exp*>(e);
+	if (bin != nullptr && bin->operator_token() == '+')
+	{
+		child_list ops, none;
+		bin->children(ops, none);
+		auto lit = ops[1]->get();
+		bin->set_pure_literal(lit->is_list_literal() && pure.pure(lit));
+	}
+	
+	child_list same, inner;
+	e->children(same, inner);
+	for (auto c : same)
+		check_concats(c->get(), pure);
+	for (auto c : inner)
+		check_concats(c->get(), pure);
+}
+
+void expression::check_tail_concats (func_body& body, purity_analysis& pure)
+{
+	for (int i = 0; i < body.params.size(); i++)
+		if (body.params.condition(i) != nullptr)
+			check_concats(body.params.condition(i).get(), pure);
+	check_concats(body.body.get(), pure);
+}
+
+
+
+// functions whose bodies have at most XY_INLINE_MAX_SIZE nodes are inlined,
+// adding at most XY_INLINE_BUDGET nodes to each scope
+#define XY_INLINE_MAX_SIZE 24
+#define XY_INLINE_BUDGET 256
+
+static bool refers_to (expression* e, function* f)
+{
+	auto v = e->const_value();
+	if (v != nullptr && v->type == value::type_function && v->func_obj.get() == f)
+		return true;
+	
+	child_list same, inner;
+	e->children(same, inner);
+	for (auto c : same)
+		if (refers_to(c->get(), f))
+			return true;
+	for (auto c : inner)
+		if (refers_to(c->get(), f))
+			return true;
+	return false;
+}
+
+// the body to inline in place of 'call', if any: the callee must be a
+// global function with one overload, no conditions, and no calls to itself
+static func_body* inline_target (call_expression* call)
+{
+	auto v = call->callee()->const_value();
+	if (v == nullptr || v->type != value::type_function || v->func_obj->is_native())
+		return nullptr;
+	
+	auto f = static_cast<soft_function*>(v->func_obj.get());
+	if (f->bodies().size() != 1 || f->memo() != nullptr)
+		return nullptr;
+	
+	auto body = f->bodies()[0].get();
+	if (body->params.size() != (int)call->arguments().size())
+		return nullptr;
+	for (int i = 0; i < body->params.size(); i++)
+		if (body->params.condition(i) != nullptr)
+			return nullptr;
+	
+	if (tree_size(body->body.get()) > XY_INLINE_MAX_SIZE ||
+			refers_to(body->body.get(), f))
+		return nullptr;
+	return body;
+}
+
+static void inline_scope (child_list& roots, int& slots)
+{
+	if (slots < 0)
+		return;
+	
+	int budget = XY_INLINE_BUDGET;
+	bool changed = true;
+	
+	// inlined bodies are scanned again, for calls they make in turn
+	while (changed)
+	{
+		changed = false;
+		
+		child_list nodes;
+		for (auto r : roots)
+			scope_nodes(r, nodes);
+		
+		for (auto n : nodes)
+		{
+			auto call = dynamic_cast<call_expression*>(n->get());
+			if (call == nullptr)
+				continue;
+			
+			auto target = inline_target(call);
+			if (target == nullptr)
+				continue;
+			
+			int size = tree_size(target->body.get());
+			if (size > budget)
+				continue;
+			
+			// the parameters take the first slots, then those of the callee
+			int nargs = call->arguments().size();
+			std::shared_ptr<inline_exp> copy(new inline_exp());
+			child_values params;
+			bool bound = false;
+			for (int i = 0; i < nargs; i++)
+			{
+				auto& arg = call->arguments()[i];
+				if (arg->const_value() != nullptr)
+					params.push_back(arg);
+				else
+				{
+					params.push_back(std::shared_ptr<expression>(new slot_exp(slots + i)));
+					copy->add(slots + i, arg);
+					bound = true;
+				}
+			}
+			
+			auto body = target->body->inline_copy(params, slots + nargs);
+			if (body == nullptr)
+				continue;
+			copy->set_body(body);
+			
+			slots += nargs + target->cache_size;
+			budget -= size;
+			if (bound)
+				*n = copy;
+			else
+				*n = body;
+			
+			changed = true;
+			break;
+		}
+	}
+}
+
+void expression::inline_calls (func_body& body)
+{
+	each_body(body, inline_scope);
+}
+
+
+
+static void self_calls (expression* e, function* self, std::vector<call_expression*>& out)
+{
+	auto call = dynamic_cast<call_expression*>(e);
+	if (call != nullptr)
+	{
+		auto v = call->callee()->const_value();
+		if (v != nullptr && v->type == value::type_function && v->func_obj.get() == self)
+			out.push_back(call);
+	}
+	
+	child_list same, inner;
+	e->children(same, inner);
+	for (auto c : same)
+		self_calls(c->get(), self, out);
+}
+
+// whether 'e' only reads parameters marked in 'invariant', in this scope
+static bool depends_on (expression* e, const std::vector<bool>& invariant)
+{
+	if (auto sym = dynamic_cast<symbol_exp*>(e))
+		return !sym->is_local() || (sym->depth() == 0 && sym->index() < (int)invariant.size() &&
+			invariant[sym->index()]);
+	
+	// hidden slots hold values computed elsewhere
+	if (dynamic_cast<slot_exp*>(e) != nullptr || dynamic_cast<cached_exp*>(e) != nullptr ||
+			dynamic_cast<inline_exp*>(e) != nullptr)
+		return false;
+	
+	child_list same, inner;
+	e->children(same, inner);
+	if (inner.size() > 0)
+		return false;
+	for (auto c : same)
+		if (!depends_on(c->get(), invariant))
+			return false;
+	return true;
+}
+
+static void hoist (std::shared_ptr<expression>& e, const std::vector<bool>& invariant,
+		function* self, purity_analysis& pure, child_values& hoisted)
+{
+	child_list same, inner;
+	e->children(same, inner);
+	
+	std::vector<call_expression*> calls;
+	self_calls(e.get(), self, calls);
+	
+	if (same.size() > 0 && inner.size() == 0 && calls.size() == 0 &&
+			dynamic_cast<cached_exp*>(e.get()) == nullptr &&
+			depends_on(e.get(), invariant) && pure.pure(e.get()))
 	{
-		unresolved,
-		resolved_global,
-		resolved_local
-	};
-	resolve_type type;
-	std::string sym;
-	int closure_index, closure_depth;
-};
+		// equivalent invariants share a slot
+		int slot = hoisted.size();
+		for (int i = 0; i < (int)hoisted.size(); i++)
+			if (hoisted[i]->equivalent(*e))
+				slot = i;
+		if (slot == (int)hoisted.size())
+			hoisted.push_back(e);
+		
+		e = std::shared_ptr<expression>(new invariant_exp(slot, e));
+		return;
+	}
+	
+	for (auto c : same)
+		hoist(*c, invariant, self, pure, hoisted);
+}
+
+int expression::hoist_invariants (const std::vector<std::shared_ptr<func_body>>& bodies,
+		function* self, purity_analysis& pure)
+{
+	if (bodies.size() == 0)
+		return 0;
+	
+	// a parameter is invariant if every self call passes it on in place
+	int nparams = bodies[0]->params.size();
+	std::vector<bool> invariant(nparams, true);
+	std::vector<call_expression*> calls;
+	for (auto& b : bodies)
+	{
+		if (b->params.size() != nparams)
+			return 0;
+		for (int i = 0; i < nparams; i++)
+			if (b->params.condition(i) != nullptr)
+				self_calls(b->params.condition(i).get(), self, calls);
+		self_calls(b->body.get(), self, calls);
+	}
+	
+	bool any = false;
+	for (int i = 0; i < nparams; i++)
+	{
+		for (auto call : calls)
+		{
+			auto& args = call->arguments();
+			auto sym = (int)args.size() == nparams ?
+				dynamic_cast<symbol_exp*>(args[i].get()) : nullptr;
+			if (sym == nullptr || !sym->is_local() || sym->depth() != 0 || sym->index() != i)
+				invariant[i] = false;
+		}
+		any = any || invariant[i];
+	}
+	if (calls.size() == 0 || !any)
+		return 0;
+	
+	for (auto call : calls)
+		if ((int)call->arguments().size() == nparams)
+			call->set_loop_site();
+	
+	// the bodies themselves are left in place, as they may end in a tail call
+	child_values hoisted;
+	for (auto& b : bodies)
+	{
+		for (int i = 0; i < nparams; i++)
+			if (b->params.condition(i) != nullptr)
+				hoist(b->params.condition(i), invariant, self, pure, hoisted);
+		
+		child_list same, inner;
+		b->body->children(same, inner);
+		for (auto c : same)
+			hoist(*c, invariant, self, pure, hoisted);
+	}
+	return hoisted.size();
+}
+
+
+
+
+void expression::fold_constants (std::shared_ptr<expression>& e, state& s)
+{
+	child_list same, inner;
+	e->children(same, inner);
+	for (auto c : same)
+		fold_constants(*c, s);
+	for (auto c : inner)
+		fold_constants(*c, s);
+	
+	if (!e->constant())
+	{
+		auto fast = e->specialize();
+		if (fast != nullptr)
+			e = fast;
+		return;
+	}
+	if (dynamic_cast<const_exp*>(e.get()) != nullptr)
+		return;
+	
+	state::scope scope(s);
+	value val;
+	if (!e->eval(val, scope))
+	{
+		// keep the expression, so the error is raised when evaluated
+		s.error().flush();
+		return;
+	}
+	
+	if (val.is_type(value::type_list) &&
+			val.list_size() > XY_FOLD_MAX_LIST)
+		return;
+	
+	e = create_const(val);
+}
+
+void expression::specialize_types (std::shared_ptr<expression>& e)
+{
+	child_list same, inner;
+	e->children(same, inner);
+	for (auto c : same)
+		specialize_types(*c);
+	for (auto c : inner)
+		specialize_types(*c);
+	
+	// quickened operators specialize further once their operands are typed
+	for (auto fast = e->specialize(); fast != nullptr; fast = e->specialize())
+	{
+		fast->proven = e->proven;
+		e = fast;
+	}
+}
+
+static bool closed_over (expression* e, int depth)
+{
+	auto sym = dynamic_cast<symbol_exp*>(e);
+	if (sym != nullptr && sym->is_local() && sym->depth() > depth)
+		return false;
+	
+	child_list same, inner;
+	e->children(same, inner);
+	for (auto c : same)
+		if (!closed_over(c->get(), depth))
+			return false;
+	for (auto c : inner)
+		if (!closed_over(c->get(), depth + 1))
+			return false;
+	return true;
+}
+
+bool expression::closed (func_body& b)
+{
+	if (b.closed < 0)
+	{
+		b.closed = closed_over(b.body.get(), 0);
+		for (int i = 0; i < b.params.size(); i++)
+			if (b.params.condition(i) != nullptr &&
+					!closed_over(b.params.condition(i).get(), 0))
+				b.closed = 0;
+	}
+	return b.closed > 0;
+}
+
+int expression::binary_section (func_body& b)
+{
+	// sections have no parameter list; they only ever read locals 0 and 1
+	if (b.params.size() != 0 && b.params.size() != 2)
+		return 0;
+	for (int i = 0; i < b.params.size(); i++)
+		if (b.params.condition(i) != nullptr)
+			return 0;
+	
+	auto e = dynamic_cast<binary_exp*>(b.body.get());
+	if (e == nullptr || !e->equivalent(binary_exp(create_closure_ref(0),
+			create_closure_ref(1), e->operator_token())))
+		return 0;
+	return e->operator_token();
+}
+
+// the same passes as a global function gets when loaded, now that calls to
+// functions passed as arguments can be inlined, and with the argument types
+// known from the start
+std::shared_ptr<func_body> expression::clone_body (func_body& b, const call_signature& sig,
+		const argument_list& args, state& s)
+{
+	child_values params;
+	for (int i = 0; i < args.size; i++)
+		if (sig.funcs[i] != nullptr)
+			params.push_back(create_const(args.values[i]));
+		else
+			params.push_back(create_closure_ref(i));
+	
+	std::shared_ptr<func_body> copy(new func_body());
+	for (int i = 0; i < b.params.size(); i++)
+		if (auto& cond = b.params.condition(i))
+		{
+			auto c = cond->inline_copy(params, 0);
+			if (c == nullptr)
+				return nullptr;
+			copy->params.add_param(b.params.param_name(i), c);
+		}
+		else
+			copy->params.add_param(b.params.param_name(i));
+	
+	copy->body = b.body->inline_copy(params, 0);
+	if (copy->body == nullptr)
+		return nullptr;
+	copy->cache_size = b.cache_size;
+	
+	child_list exps;
+	for (int i = 0; i < copy->params.size(); i++)
+		if (copy->params.condition(i) != nullptr)
+			exps.push_back(&copy->params.condition(i));
+	exps.push_back(&copy->body);
+	
+	for (auto e : exps)
+		fold_constants(*e, s);
+	inline_calls(*copy);
+	for (auto e : exps)
+		fold_constants(*e, s);
+	
+	type_analysis types;
+	types.closed = s.is_sealed();
+	type_facts facts;
+	for (int i = 0; i < args.size; i++)
+		facts.set_local(i, sig.types[i]);
+	types.body(*copy, facts);
+	
+	for (auto e : exps)
+		specialize_types(*e);
+	return copy;
+}
 
 std::shared_ptr<expression> expression::create_const (const value& val)
 {
@@ -627,8 +2695,26 @@ std::shared_ptr<expression> expression::create_binary (const std::shared_ptr<exp
 		ce->add(a);
 		return ce;
 	}
-	else
+	
+	switch (op)
+	{
+#define XY_NUMBER_BINARY(o) \
+	case o: return std::shared_ptr<expression>(new number_binary_exp<o>(a, b));
+	XY_NUMBER_BINARY('+')
+	XY_NUMBER_BINARY('-')
+	XY_NUMBER_BINARY('*')
+	XY_NUMBER_BINARY('/')
+	XY_NUMBER_BINARY('%')
+	XY_NUMBER_BINARY('^')
+	XY_NUMBER_BINARY('<')
+	XY_NUMBER_BINARY('>')
+	XY_NUMBER_BINARY(lexer::token::eql_token)
+	XY_NUMBER_BINARY(lexer::token::gre_token)
+	XY_NUMBER_BINARY(lexer::token::lse_token)
+#undef XY_NUMBER_BINARY
+	default:
 		return std::shared_ptr<expression>(new binary_exp(a, b, op));
+	}
 }
 std::shared_ptr<expression> expression::create_symbol (const std::string& sym)
 {
@@ -642,6 +2728,10 @@ std::shared_ptr<expression> expression::create_unary (const std::shared_ptr<expr
 {
 	return std::shared_ptr<expression>(new unary_exp(a, op));
 }
+std::shared_ptr<expression> expression::create_cached (int slot, const std::shared_ptr<expression>& e)
+{
+	return std::shared_ptr<expression>(new cached_exp(slot, e));
+}
 
 
 
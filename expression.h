@@ -1,8 +1,12 @@
 #pragma once
 
 #include "parser.h"
+#include "function.h"
 #include "map.h"
 
+#include <set>
+#include <map>
+
 namespace xy {
 
 class param_list;
@@ -31,18 +35,47 @@ struct symbol_locator
 
 
 
+class expression;
+struct func_body;
+struct bytecode;
+class jit_builder;
+class cpp_writer;
+class purity_analysis;
+class type_analysis;
+struct type_facts;
+typedef std::vector<std::shared_ptr<expression>*> child_list;
+typedef std::vector<std::shared_ptr<expression>> child_values;
+
 class expression
 {
 public:
 	// inline expression () {}
 	
+	// when 'func' is non-null, the expression is in tail position of that
+	// function and may hand its final call back to the caller's trampoline
+	// instead of performing it (see soft_function::call)
 	struct tail_call
 	{
 		tail_call (function* f);
 		
 		function* func;
+		std::shared_ptr<function> target;
 		std::vector<value> args;
 		bool do_tail;
+		// passes on the parameters the invariants of 'func' depend on
+		bool loop;
+		
+		// list operands waiting to be concatenated onto the result of the
+		// tail call, as in '[x] + f(y)'; outermost first
+		struct pending_concat
+		{
+			value val;
+			bool left;
+		};
+		std::vector<pending_concat> pending;
+		
+		// those from index 'from' on, which are then dropped
+		bool finish (value& out, state& parent, size_t from = 0);
 	};
 	
 	virtual ~expression ();
@@ -51,6 +84,76 @@ public:
 	
 	virtual bool locate_symbols (const std::shared_ptr<symbol_locator>& locator);
 	virtual bool constant () const;
+	virtual bool is_list_literal () const;
+	
+	// collects the sub-expressions of this node for passes that rewrite the
+	// tree; 'inner' receives those evaluated in a closure of their own
+	virtual void children (child_list& same, child_list& inner);
+	
+	// the closure built for the 'inner' children, if they all share one per
+	// evaluation: returns its number of hidden cache slots, else nullptr
+	virtual int* inner_cache_size ();
+	// the function bodies of a lambda
+	virtual void function_bodies (std::vector<std::shared_ptr<func_body>>& out);
+	
+	// the value of a constant node, else nullptr
+	virtual const value* const_value () const;
+	// structural equality of resolved expressions
+	virtual bool equivalent (const expression& other) const;
+	// a copy for inlining into another body, where local symbol 'i' is
+	// replaced by 'params[i]' and hidden slots are shifted by 'slot_base';
+	// nullptr for nodes that cannot be inlined
+	virtual std::shared_ptr<expression> inline_copy (const child_values& params, int slot_base);
+	// a faster equivalent of this node once symbols are located and
+	// constants folded, else nullptr
+	virtual std::shared_ptr<expression> specialize ();
+	// emits vm code leaving the value on the stack; nodes without their own
+	// instructions are evaluated by the tree interpreter
+	virtual void compile (bytecode& code, bool tail);
+	// emits machine code leaving the value in xmm0 (see jit.h); false for
+	// anything the jit does not cover
+	virtual bool compile_native (jit_builder& code, bool tail);
+	// writes C++ statements computing the value (see translate.h); false
+	// for nodes left to the interpreter
+	virtual bool emit_cpp (cpp_writer& code, std::string& result, bool tail);
+	
+	// the type of the value, once proven by a type_analysis
+	inline value::value_type proven_type () const { return proven; }
+	// the type of the value, adding to 'facts' what a successful evaluation
+	// of the node proves about locals; returns type_analysis::type_none for
+	// nodes known not to produce a value yet
+	virtual int infer (type_analysis& types, type_facts& facts);
+	// adds to 'facts' that the value has type 't', or is true
+	virtual void assume_type (type_facts& facts, value::value_type t);
+	virtual void assume_true (type_facts& facts);
+	
+	// replaces constant subtrees with their values, once symbols are located
+	static void fold_constants (std::shared_ptr<expression>& e, state& s);
+	// stores repeated pure subexpressions of a function body in hidden
+	// closure slots, computed on first use
+	static void eliminate_common (func_body& body, purity_analysis& pure);
+	// lets 'f(y) + [x]' in tail position evaluate its literal before the
+	// body of 'f' runs, where no one can tell the difference: the literal
+	// is pure
+	static void check_tail_concats (func_body& body, purity_analysis& pure);
+	// replaces calls to small global functions with copies of their bodies
+	static void inline_calls (func_body& body);
+	// stores pure subexpressions of the overloads of 'self' that depend only
+	// on parameters every self call passes on unchanged in hidden slots kept
+	// across those calls, when made in tail position; returns their number
+	static int hoist_invariants (const std::vector<std::shared_ptr<func_body>>& bodies,
+			function* self, purity_analysis& pure);
+	// replaces operators on proven types with unchecked kernels
+	static void specialize_types (std::shared_ptr<expression>& e);
+	// a copy of 'b' optimized for arguments of signature 'sig', such as
+	// 'args', with the functions it tells apart as constants; else nullptr
+	static std::shared_ptr<func_body> clone_body (func_body& b, const call_signature& sig,
+			const argument_list& args, state& s);
+	// whether 'b' refers to no locals of enclosing closures
+	static bool closed (func_body& b);
+	// the operator if 'b' applies one to its first two parameters as is,
+	// else 0
+	static int binary_section (func_body& b);
 	
 	static std::shared_ptr<expression> create_const (const value& val);
 	static std::shared_ptr<expression> create_binary (const std::shared_ptr<expression>& a,
@@ -59,6 +162,68 @@ public:
 	static std::shared_ptr<expression> create_unary (const std::shared_ptr<expression>& a, int op);
 	static std::shared_ptr<expression> create_symbol (const std::string& sym);
 	static std::shared_ptr<expression> create_closure_ref (int index, int depth = 0);
+	static std::shared_ptr<expression> create_cached (int slot, const std::shared_ptr<expression>& e);
+	
+protected:
+	friend class type_analysis;
+	value::value_type proven = value::type_any;
+};
+
+
+// decides which expressions can be evaluated once for several uses: no
+// I/O natives, and no calls to unknown functions
+class purity_analysis
+{
+public:
+	bool pure (expression* e);
+	
+private:
+	bool locally_pure (expression* e);
+	bool pure_function (const value* v);
+	void analyze (function* f);
+	
+	std::set<function*> analyzed;
+	std::set<function*> impure;
+};
+
+
+// the types known for the parameters and hidden slots of a closure at some
+// point of its evaluation; type_any where unknown
+struct type_facts
+{
+	value::value_type local (int index) const;
+	value::value_type slot (int s) const;
+	void set_local (int index, value::value_type t);
+	void set_slot (int s, value::value_type t);
+	
+	std::vector<value::value_type> locals, slots;
+};
+
+// proves the types of expressions from literals, guards such as 'n > 0' or
+// constant parameters, and the result types of natives and other functions.
+// the results of the global soft functions are found together, starting
+// from 'no result' and iterating until none changes
+class type_analysis
+{
+public:
+	enum { type_none = -1 };
+	
+	void run (environment& env);
+	int visit (expression& e, type_facts& facts);
+	int body (func_body& b, const type_facts& given = type_facts());
+	int result (function* f);
+	static int join (int a, int b);
+	
+	// over all global functions, in the last run
+	int nodes = 0, proven = 0;
+	// whether the global functions can gain no more overloads (see
+	// state::seal); until then their results are not trusted
+	bool closed = false;
+	
+private:
+	std::map<function*, int> results;
+	std::map<expression*, value::value_type> seen;
+	bool counting = false;
 };
 
 
@@ -80,12 +245,35 @@ public:
 	virtual bool eval (value& out, state::scope& scope);
 	virtual bool eval_tail_call (tail_call& tc, value& out, state::scope& scope);
 	virtual bool locate_symbols (const std::shared_ptr<symbol_locator>& locator);
+	virtual void children (child_list& same, child_list& inner);
+	virtual bool equivalent (const expression& other) const;
+	virtual std::shared_ptr<expression> inline_copy (const child_values& params, int slot_base);
+	virtual void compile (bytecode& code, bool tail);
+	virtual bool compile_native (jit_builder& code, bool tail);
+	virtual bool emit_cpp (cpp_writer& code, std::string& result, bool tail);
+	virtual int infer (type_analysis& types, type_facts& facts);
 	
 	void add (const std::shared_ptr<expression>& arg);
 	
+	inline const std::shared_ptr<expression>& callee () const { return func_exp; }
+	inline const std::vector<std::shared_ptr<expression>>& arguments () const { return args; }
+	// a self call passing on the loop invariants (see hoist_invariants)
+	inline void set_loop_site () { loop_site = true; }
+	
 private:
 	std::shared_ptr<expression> func_exp;
 	std::vector<std::shared_ptr<expression>> args;
+	
+	// the last callee and signature seen here, and how many calls in a row
+	// had them; past a threshold, its clone for them is called instead
+	std::shared_ptr<function> site_callee;
+	call_signature site_sig;
+	int site_calls = 0, site_revision = 0;
+	std::shared_ptr<function> site_clone;
+	bool loop_site = false;
+	
+	const std::shared_ptr<function>& bind (const std::shared_ptr<function>& func,
+			const argument_list& args, state& s);
 };
 
 class list_expression :
@@ -97,6 +285,13 @@ public:
 	virtual bool eval (value& out, state::scope& scope);
 	virtual bool locate_symbols (const std::shared_ptr<symbol_locator>& locator);
 	virtual bool constant () const;
+	virtual bool is_list_literal () const;
+	virtual void children (child_list& same, child_list& inner);
+	virtual bool equivalent (const expression& other) const;
+	virtual std::shared_ptr<expression> inline_copy (const child_values& params, int slot_base);
+	virtual void compile (bytecode& code, bool tail);
+	virtual bool emit_cpp (cpp_writer& code, std::string& result, bool tail);
+	virtual int infer (type_analysis& types, type_facts& facts);
 	void add (const std::shared_ptr<expression>& arg);
 	
 private:
@@ -112,12 +307,19 @@ public:
 	virtual bool eval (value& out, state::scope& scope);
 	virtual bool locate_symbols (const std::shared_ptr<symbol_locator>& locator);
 	virtual bool constant () const;
+	virtual void children (child_list& same, child_list& inner);
 	
 	inline void set_filter (const std::shared_ptr<expression>& e) { filter = e; }
 	inline void set_map (const std::shared_ptr<expression>& e) { map = e; }
+	// 'a $$ x ...': the items are taken in chunks by the workers
+	inline void set_parallel (bool p) { parallel = p; }
 private:
 	std::string it_name;
 	std::shared_ptr<expression> start, filter, map;
+	bool parallel;
+	
+	bool eval_items (std::vector<value>& output, list& items, int first, int end,
+			state::scope& scope);
 };
 
 
@@ -132,6 +334,8 @@ public:
 	virtual bool eval_tail_call (tail_call& tc, value& out, state::scope& scope);
 	virtual bool locate_symbols (const std::shared_ptr<symbol_locator>& locator);
 	virtual bool constant () const;
+	virtual void children (child_list& same, child_list& inner);
+	virtual int* inner_cache_size ();
 	
 	bool add (const std::string& name, const std::shared_ptr<expression>& val);
 	bool add_list (const std::vector<std::string>& names, const std::shared_ptr<expression>& val, bool va);
@@ -157,7 +361,7 @@ private:
 	
 	std::vector<var> vars;
 	std::shared_ptr<expression> body;
-	int closure_size;
+	int closure_size, cache_size;
 };
 
 
@@ -170,6 +374,7 @@ class map_expression :
 public:
 	virtual bool eval (value& out, state::scope& scope);
 	virtual bool locate_symbols (const std::shared_ptr<symbol_locator>& locator);
+	virtual void children (child_list& same, child_list& inner);
 	
 	bool add (const std::string& name, const std::shared_ptr<expression>& val);
 	
@@ -186,6 +391,9 @@ public:
 	
 	virtual bool eval (value& out, state::scope& scope);
 	virtual bool locate_symbols (const std::shared_ptr<symbol_locator>& locator);
+	virtual void children (child_list& same, child_list& inner);
+	virtual bool equivalent (const expression& other) const;
+	virtual std::shared_ptr<expression> inline_copy (const child_values& params, int slot_base);
 	
 private:
 	std::shared_ptr<expression> left;
@@ -4,6 +4,9 @@
 #include "lexer.h"
 #include "parser.h"
 #include "expression.h"
+#include "memo.h"
+#include "vm.h"
+#include "jit.h"
 
 namespace xy {
 
@@ -11,9 +14,16 @@ namespace xy {
 // not sure about this one, yet
 /*  #define XY_REVERSE_OVERLOAD_ORDER */
 
+#define XY_JIT_THRESHOLD  2
+#define XY_JIT_MAX_BAILS  16
+
+// signatures a function is cloned for, at most
+#define XY_MAX_CLONES  8
+
 
 function::function (const std::string& name, bool n)
-	: func_name(name), native(n)
+	: func_name(name), native(n), func_purity(purity_impure),
+	  func_called(1), func_result(value::type_any), func_redefinable(false)
 { }
 
 function::~function () {}
@@ -70,6 +80,54 @@ value argument_list::get (int i) const
 }
 
 
+void call_signature::assign (const argument_list& args)
+{
+	types.resize(args.size);
+	funcs.resize(args.size);
+	for (int i = 0; i < args.size; i++)
+	{
+		types[i] = args.values[i].type;
+		funcs[i] = identity(args.values[i]);
+	}
+}
+
+bool call_signature::matches (const argument_list& args) const
+{
+	if (args.size != (int)types.size())
+		return false;
+	for (int i = 0; i < args.size; i++)
+		if (args.values[i].type != types[i] ||
+				(funcs[i] != nullptr && identity(args.values[i]) != funcs[i]))
+			return false;
+	return true;
+}
+
+bool call_signature::operator< (const call_signature& other) const
+{
+	if (types != other.types)
+		return types < other.types;
+	return funcs < other.funcs;
+}
+
+// lambdas are made anew at each evaluation, but those that capture nothing
+// behave the same as any other made from the same expression
+const void* call_signature::identity (const value& v)
+{
+	if (v.type != value::type_function)
+		return nullptr;
+	
+	auto f = v.func_obj.get();
+	if (f->is_native() || !f->is_lambda())
+		return f;
+	
+	auto& bodies = static_cast<soft_function*>(f)->bodies();
+	for (auto& b : bodies)
+		if (!expression::closed(*b))
+			return nullptr;
+	return bodies.size() > 0 ? bodies[0].get() : nullptr;
+}
+
+
 bool argument_list::check (const std::string& fname, state& s,
 				const std::initializer_list<value::value_type>& types, bool err) const
 {
@@ -117,7 +175,7 @@ std::string param_list::param_name (int index) const
 {
 	return params[index].name;
 }
-std::shared_ptr<expression> param_list::condition (int index)
+std::shared_ptr<expression>& param_list::condition (int index)
 {
 	return params[index].cond;
 }
@@ -175,35 +233,229 @@ bool param_list::satisfies (bool& out, state::scope& scope)
 
 
 soft_function::soft_function (const std::string& n)
-	: function(n, false), parent_closure(nullptr)
+	: function(n, false), parent_closure(nullptr), memo_results(nullptr), cache_size(-1),
+	  compiled(nullptr), compiled_params(0), jit_calls(0), jit_bails(0), jit_disabled(false),
+	  is_clone(false), loop_slots(0), hoisted(false)
 { }
 
 soft_function::soft_function (const std::shared_ptr<closure>& scope)
-	: function("", false), parent_closure(scope)
+	: function("", false), parent_closure(scope), memo_results(nullptr), cache_size(-1),
+	  compiled(nullptr), compiled_params(0), jit_calls(0), jit_bails(0), jit_disabled(false),
+	  is_clone(false), loop_slots(0), hoisted(false)
+{ }
+
+soft_function::soft_function (const soft_function& other)
+	: function(other), overloads(other.overloads), parent_closure(other.parent_closure),
+	  memo_results(other.memo_results), cache_size(-1),
+	  compiled(other.compiled), compiled_params(other.compiled_params),
+	  jit_calls(0), jit_bails(0), jit_disabled(false),
+	  is_clone(other.is_clone), loop_slots(other.loop_slots), hoisted(other.hoisted)
 { }
 
 soft_function::~soft_function () {}
 
+void soft_function::release ()
+{
+	for (auto& c : clones)
+		if (c.second != nullptr)
+			static_cast<soft_function*>(c.second.get())->release();
+	clones.clear();
+	overloads.clear();
+	memo_results = nullptr;
+	parent_closure = nullptr;
+}
+
 
 void soft_function::add_overload (const std::shared_ptr<func_body>& o)
 {
 	overloads.push_back(o);
+	cache_size = -1;
+	clones.clear();
+	loop_slots = 0;
+	jit_calls = 0;
+	if (jit_code != nullptr)
+		jit_disabled = true;
+}
+
+// overloads number their cache slots independently, and the cache is
+// cleared before moving on to the next overload
+int soft_function::closure_cache_size ()
+{
+	if (cache_size < 0)
+	{
+		int size = 0;
+		for (auto& o : overloads)
+			if (o->cache_size > size)
+				size = o->cache_size;
+		cache_size = size;
+	}
+	return cache_size;
+}
+
+// compiles the function after XY_JIT_THRESHOLD calls with numbers only,
+// and gives up on it after XY_JIT_MAX_BAILS calls left to the interpreter;
+// false if this call should be interpreted
+bool soft_function::call_native (value& out, const value* args, int nargs, state& s)
+{
+	if (jit_disabled)
+		return false;
+	for (int i = 0; i < nargs; i++)
+		if (args[i].type != value::type_number)
+			return false;
+	
+	if (jit_code == nullptr)
+	{
+		if (++jit_calls < XY_JIT_THRESHOLD)
+			return false;
+		
+		jit_code = jit_function::compile(*this, s);
+		if (jit_code == nullptr)
+		{
+			jit_disabled = true;
+			return false;
+		}
+	}
+	
+	if (jit_code->params() == nargs && jit_code->run(out, args))
+		return true;
+	
+	if (++jit_bails >= XY_JIT_MAX_BAILS)
+		jit_disabled = true;
+	return false;
+}
+
+std::shared_ptr<function> soft_function::clone_for (const call_signature& sig,
+		const argument_list& args, state& s)
+{
+	auto it = clones.find(sig);
+	if (it != clones.end())
+		return it->second;
+	
+	// memo tables and translated code belong to the original
+	if (is_clone || memo_results != nullptr || compiled != nullptr ||
+			args.size == 0 || clones.size() >= XY_MAX_CLONES)
+		return nullptr;
+	
+	std::shared_ptr<soft_function> copy(new soft_function(func_name));
+	copy->parent_closure = parent_closure;
+	copy->func_purity = func_purity;
+	copy->func_result = func_result;
+	copy->is_clone = true;
+	
+	for (auto& o : overloads)
+	{
+		auto body = o->params.size() == args.size ?
+			expression::clone_body(*o, sig, args, s) : nullptr;
+		if (body == nullptr)
+		{
+			copy = nullptr;
+			break;
+		}
+		copy->overloads.push_back(body);
+	}
+	
+	// the calls of the copies still name the original
+	if (copy != nullptr)
+	{
+		purity_analysis pure;
+		for (auto& o : copy->overloads)
+			expression::check_tail_concats(*o, pure);
+		copy->loop_slots = expression::hoist_invariants(copy->overloads, this, pure);
+		copy->hoisted = true;
+	}
+	
+	clones[sig] = copy;
+	return copy;
+}
+
+int soft_function::section () const
+{
+	if (overloads.size() != 1 || memo_results != nullptr)
+		return 0;
+	return expression::binary_section(*overloads[0]);
+}
+
+void soft_function::hoist_invariants (purity_analysis& pure)
+{
+	if (hoisted)
+		return;
+	
+	hoisted = true;
+	loop_slots = expression::hoist_invariants(overloads, this, pure);
+}
+
+void soft_function::memoize (int capacity)
+{
+	if (memo_results == nullptr || memo_results->capacity() != capacity)
+		memo_results = std::shared_ptr<memo_table>(new memo_table(capacity));
 }
 
 bool soft_function::call (value& out, const argument_list& args, state::scope& parent)
 {
-	state::scope scope(parent(), std::shared_ptr<closure>(new closure(args, parent_closure)));
+	if (memo_results != nullptr &&
+			memo_results->find(args, out, parent()))
+		return true;
+	
+	if (parent().get_jit() && memo_results == nullptr &&
+			call_native(out, args.values, args.size, parent()))
+		return true;
+	
+	state::depth_guard depth(parent());
+	if (!depth.check())
+		return false;
+	
+	if (compiled != nullptr && args.size == compiled_params)
+	{
+		if (!compiled(out, args, parent()))
+			return false;
+		
+		if (memo_results != nullptr)
+			memo_results->insert(args, out, parent());
+		return true;
+	}
+	
+	if (parent().get_engine() == state::engine_vm)
+	{
+		if (!parent().machine().call(out, this, args))
+			return false;
+		
+		if (memo_results != nullptr)
+			memo_results->insert(args, out, parent());
+		return true;
+	}
+	
+	state::scope scope(parent(), std::shared_ptr<closure>(
+		new closure(args, parent_closure, closure_cache_size(), loop_slots)));
 	std::shared_ptr<expression> to_eval(nullptr);
 	
+	// the function currently being evaluated; tail calls to other soft
+	// functions switch this instead of growing the C++ stack
+	soft_function* current = this;
+	std::shared_ptr<function> current_ref(nullptr);
+	expression::tail_call tc(this);
+	
+	// tail calls to memoized functions, whose results are stored once
+	// known: that of the loop, with the concatenations left from then on
+	struct memo_call
+	{
+		soft_function* func;
+		std::vector<value> args;
+		size_t pending;
+	};
+	std::vector<memo_call> memo_calls;
+	
 tail_call_recur_point: // if tail call successful, goto here
 	
 #ifdef XY_REVERSE_OVERLOAD_ORDER
-	for (auto it = overloads.crbegin(); it != overloads.crend(); it++)
+	for (auto it = current->overloads.crbegin(); it != current->overloads.crend(); it++)
 #else
-	for (auto it = overloads.cbegin(); it != overloads.cend(); it++)
+	for (auto it = current->overloads.cbegin(); it != current->overloads.cend(); it++)
 #endif
 	{
 		bool good = false;
+		if (current->cache_size > 0)
+			scope.local->clear_cache();
+		
 		if (!(*it)->params.satisfies(good, scope))
 			return false;
 		
@@ -218,33 +470,75 @@ tail_call_recur_point: // if tail call successful, goto here
 	{
 		auto& err = parent().error().die();
 		err << "No suitable overload for ";
-		if (func_name.size() == 0)
+		if (current->is_lambda())
 			err << "lambda function";
 		else
-			err << "function '" << func_name << "'";
+			err << "function '" << current->name() << "'";
 		err << " found";
 		return false;
 	}
 	else
 	{
-		expression::tail_call tc(this);
+		tc.func = current;
+		tc.do_tail = false;
+		tc.loop = false;
+		tc.args.clear();
 		
 		if (!to_eval->eval_tail_call(tc, out, scope))
 			return false;
 		
 		if (tc.do_tail)
 		{
-			std::shared_ptr<closure> new_closure(new closure(tc.args.size(), parent_closure));
-			int i = 0;
-			for (auto& v : tc.args)
-				new_closure->set(i++, v);
+			auto previous = current;
+			current_ref = std::move(tc.target);
+			current = static_cast<soft_function*>(current_ref.get());
 			
-			to_eval = nullptr;
-			scope.local = new_closure;
+			bool found = false;
+			if (current->memo_results != nullptr)
+			{
+				argument_list targs(tc.args.size());
+				std::copy(tc.args.begin(), tc.args.end(), targs.values);
+				found = current->memo_results->find(targs, out, parent());
+				if (!found)
+					memo_calls.push_back({ current, tc.args, tc.pending.size() });
+			}
 			
-			goto tail_call_recur_point;
+			// loops of tail calls are compiled as well
+			if (!found && !(parent().get_jit() && current->memo_results == nullptr &&
+					current->call_native(out, tc.args.data(), tc.args.size(), parent())))
+			{
+				std::shared_ptr<closure> new_closure(new closure(tc.args.size(),
+					current->parent_closure, current->closure_cache_size(),
+					current->loop_slots));
+				int i = 0;
+				for (auto& v : tc.args)
+					new_closure->set(i++, v);
+				
+				if (tc.loop && current == previous && current->loop_slots > 0)
+					new_closure->keep_invariants(*scope.local);
+				
+				to_eval = nullptr;
+				scope.local = new_closure;
+				
+				goto tail_call_recur_point;
+			}
 		}
 		
+		for (auto it = memo_calls.rbegin(); it != memo_calls.rend(); it++)
+		{
+			if (!tc.finish(out, parent(), it->pending))
+				return false;
+			
+			argument_list targs(it->args.size());
+			std::copy(it->args.begin(), it->args.end(), targs.values);
+			it->func->memo_results->insert(targs, out, parent());
+		}
+		
+		if (!tc.finish(out, parent()))
+			return false;
+		
+		if (memo_results != nullptr)
+			memo_results->insert(args, out, parent());
 		return true;
 	}
 }
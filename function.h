@@ -3,13 +3,20 @@
 #include "state.h"
 #include "value.h"
 
+#include <atomic>
 #include <initializer_list>
+#include <map>
+#include <mutex>
 
 namespace xy {
 
 
 class param_list;
 class expression;
+class memo_table;
+struct bytecode;
+class jit_function;
+class purity_analysis;
 
 struct argument_list
 {
@@ -27,6 +34,22 @@ struct argument_list
 	value* values;
 };
 
+// the types of the arguments of a call, and the functions among them where
+// they can be told apart (see soft_function::clone_for)
+struct call_signature
+{
+	void assign (const argument_list& args);
+	bool matches (const argument_list& args) const;
+	bool operator< (const call_signature& other) const;
+	
+	// the function object, or for lambdas that refer to no enclosing
+	// locals, their first body; else nullptr
+	static const void* identity (const value& v);
+	
+	std::vector<value::value_type> types;
+	std::vector<const void*> funcs;
+};
+
 
 class function
 {
@@ -34,15 +57,41 @@ public:
 	function (const std::string& name, bool native = true);
 	virtual ~function ();
 	
+	// whether calls to a native may be evaluated once for repeated
+	// arguments; 'higher order' natives are pure if their arguments are
+	enum purity_type
+	{
+		purity_impure = 0,
+		purity_pure,
+		purity_higher_order
+	};
+	
 	inline bool is_native () const { return native; }
 	inline std::string name () const { return func_name; }
 	inline bool is_lambda () const { return func_name.size() == 0; }
+	inline purity_type purity () const { return func_purity; }
+	inline void set_purity (purity_type p) { func_purity = p; }
+	// the argument positions a 'higher order' native may call, as bits;
+	// the first argument unless set otherwise
+	inline bool calls_argument (size_t i) const { return i < 32 && (func_called >> i) & 1; }
+	inline void set_called_arguments (unsigned bits) { func_called = bits; }
+	// the type of every value returned, or type_any (see type_analysis)
+	inline value::value_type result_type () const { return func_result; }
+	inline void set_result_type (value::value_type t) { func_result = t; }
+	// whether a program may define a function of the same name, which
+	// then replaces the native
+	inline bool redefinable () const { return func_redefinable; }
+	inline void set_redefinable (bool r) { func_redefinable = r; }
 	
 	virtual bool call (value& out, const argument_list& args, state::scope& scope);
 	bool call (value& out, const argument_list& args, state& s);
 protected:
 	std::string func_name;
 	bool native;
+	purity_type func_purity;
+	unsigned func_called;
+	value::value_type func_result;
+	bool func_redefinable;
 };
 
 
@@ -60,7 +109,7 @@ public:
 	// let (value) = ...
 	void add_param (std::shared_ptr<expression> a);
 	
-	std::shared_ptr<expression> condition (int index);
+	std::shared_ptr<expression>& condition (int index);
 	std::shared_ptr<expression> condition (const std::string& name);
 	
 	int size () const;
@@ -93,6 +142,11 @@ struct func_body
 {
 	param_list params;
 	std::shared_ptr<expression> body;
+	int cache_size = 0; // hidden closure slots used by the guards and body
+	std::shared_ptr<bytecode> compiled; // for the vm, built on first use
+	std::once_flag compile_once;
+	int closed = -1; // whether it refers to no enclosing locals, once known
+	std::atomic<long> spawn_ns {-1}; // longest run when spawned, if ever
 };
 
 
@@ -103,15 +157,74 @@ public:
 	soft_function (const std::string& name);
 	// lambda
 	soft_function (const std::shared_ptr<closure>& scope);
+	// the same overloads, with caches and compiled code of its own
+	soft_function (const soft_function& other);
 	
 	virtual ~soft_function ();
 	
 	void add_overload (const std::shared_ptr<func_body>& o);
+	// drops the overloads, clones and cached results, whose folded
+	// constants and bound call sites refer back to functions, so that the
+	// environment holding it can be freed
+	void release ();
+	inline const std::vector<std::shared_ptr<func_body>>& bodies () const { return overloads; }
+	// changes with every overload added, which leaves clones out of date
+	inline int revision () const { return overloads.size(); }
+	
+	// cache results in a table of at most 'capacity' entries
+	void memoize (int capacity);
+	inline std::shared_ptr<memo_table> memo () const { return memo_results; }
+	
+	// C++ translated ahead of time (see translate.h), run instead of the
+	// overloads when called with 'params' arguments
+	typedef bool (*compiled_body)(value& out, const argument_list& args, state& s);
+	inline void set_compiled (compiled_body b, int params)
+	{
+		compiled = b;
+		compiled_params = params;
+	}
+	
+	// a version re-optimized for calls of signature 'sig', such as 'args',
+	// made once and shared by the call sites that bind to it; nullptr if
+	// none can be made
+	std::shared_ptr<function> clone_for (const call_signature& sig,
+			const argument_list& args, state& s);
+	
+	// the operator of a section such as '(&+)', or of a lambda written
+	// out as '@(x, y) = x + y'; else 0
+	int section () const;
+	
+	// hoists loop invariants out of the overloads (see
+	// expression::hoist_invariants), once: overloads added later may change
+	// what the self tail calls pass on, and leave the invariants unkept
+	void hoist_invariants (purity_analysis& pure);
 	
 	virtual bool call (value& out, const argument_list& args, state::scope& scope);
 private:
+	friend class vm;
+	friend class jit_builder;
+	
 	std::vector<std::shared_ptr<func_body>> overloads;
 	std::shared_ptr<closure> parent_closure;
+	std::shared_ptr<memo_table> memo_results;
+	std::atomic<int> cache_size; // worked out on first call, by any thread
+	compiled_body compiled;
+	int compiled_params;
+	
+	// machine code, once called often enough with numbers; compiled code
+	// of callers refers to it, so it is kept even once disabled
+	std::shared_ptr<jit_function> jit_code;
+	int jit_calls, jit_bails;
+	bool jit_disabled;
+	
+	std::map<call_signature, std::shared_ptr<function>> clones;
+	bool is_clone;
+	
+	int loop_slots;
+	bool hoisted;
+	
+	int closure_cache_size ();
+	bool call_native (value& out, const value* args, int nargs, state& s);
 };
 
 
@@ -0,0 +1,684 @@
+#include "include.h"
+#include "jit.h"
+#include "expression.h"
+#include "function.h"
+#include "lexer.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#define XY_JIT_X86_64
+#include <sys/mman.h>
+#endif
+
+namespace xy {
+
+
+// functions with more parameters than this are not compiled
+#define XY_JIT_MAX_PARAMS 16
+
+typedef int (*jit_entry)(const double* args, double* out);
+
+
+jit_function::jit_function ()
+	: code(nullptr), code_size(0), nparams(0), result_kind(kind_unknown)
+{ }
+
+jit_function::~jit_function ()
+{
+#ifdef XY_JIT_X86_64
+	if (code != nullptr)
+		munmap(code, code_size);
+#endif
+}
+
+// the code takes a pointer to its last argument, with the others above it
+bool jit_function::run (value& out, const value* args)
+{
+	double in[XY_JIT_MAX_PARAMS], result;
+	for (int i = 0; i < nparams; i++)
+		in[nparams - 1 - i] = args[i].num;
+	
+	if (reinterpret_cast<jit_entry>(code)(in, &result) != 0)
+		return false;
+	
+	if (result_kind == kind_bool)
+		out = value::from_bool(result != 0);
+	else
+		out = value::from_number(result);
+	return true;
+}
+
+std::shared_ptr<jit_function> jit_function::compile (soft_function& f, state& s)
+{
+	std::set<soft_function*> busy;
+	return compile(f, s, busy);
+}
+
+std::shared_ptr<jit_function> jit_function::compile (soft_function& f, state& s,
+		std::set<soft_function*>& busy)
+{
+	// the result kind is assumed for self calls, so try both
+	for (auto k : { kind_number, kind_bool })
+	{
+		jit_builder b(f, s, busy, k);
+		bool good = b.build();
+		busy.erase(&f);
+		if (!good)
+			continue;
+
+#ifdef XY_JIT_X86_64
+		std::shared_ptr<jit_function> out(new jit_function());
+		out->code_size = b.buf.size();
+		out->code = mmap(nullptr, out->code_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (out->code == MAP_FAILED)
+		{
+			out->code = nullptr;
+			return nullptr;
+		}
+		
+		memcpy(out->code, b.buf.data(), out->code_size);
+		if (mprotect(out->code, out->code_size, PROT_READ | PROT_EXEC) != 0)
+			return nullptr;
+		
+		out->nparams = b.nparams;
+		out->result_kind = k;
+		return out;
+#else
+		return nullptr;
+#endif
+	}
+	return nullptr;
+}
+
+
+
+
+
+
+// frame, below the saved rbp: parameters, the result pointer, hidden slots
+// and the 'filled' flags of cached slots
+int jit_builder::param_disp (int i) const { return -8 * (i + 1); }
+int jit_builder::out_disp () const { return -8 * (nparams + 1); }
+int jit_builder::slot_disp (int s) const { return -8 * (nparams + 2 + s); }
+int jit_builder::flag_disp (int s) const { return -8 * (nparams + 2 + nslots + s); }
+
+
+jit_builder::jit_builder (soft_function& f, state& s, std::set<soft_function*>& b,
+		jit_function::kind r)
+	: func(f), parent(s), busy(b), nparams(-1), nslots(0), depth(0),
+	  dispatch(0), last(jit_function::kind_unknown), result(r)
+{ }
+
+bool jit_builder::build ()
+{
+#ifndef XY_JIT_X86_64
+	return false;
+#else
+	auto& bodies = func.bodies();
+	if (bodies.size() == 0 || func.memo() != nullptr)
+		return false;
+	
+	nparams = bodies[0]->params.size();
+	for (auto& b : bodies)
+	{
+		if (b->params.size() != nparams)
+			return false;
+		if (b->cache_size > nslots)
+			nslots = b->cache_size;
+	}
+	if (nparams > XY_JIT_MAX_PARAMS)
+		return false;
+	
+	busy.insert(&func);
+	
+	// push rbp; mov rbp, rsp; sub rsp, frame
+	int frame = nparams + 1 + 2 * nslots;
+	frame += frame % 2;
+	emit({ 0x55, 0x48, 0x89, 0xE5, 0x48, 0x81, 0xEC });
+	emit32(8 * frame);
+	
+	// counts as a call for --max-depth, and bails out rather than run into
+	// the end of the stack; the interpreter then reports either
+	emit({ 0x48, 0xB8 });                       // mov rax, &depth
+	emit64((uint64_t)parent.depth_address());
+	emit({ 0xFF, 0x00, 0x8B, 0x08, 0x48, 0xBA });  // inc [rax]; mov ecx, [rax]
+	emit64((uint64_t)parent.max_depth_address());
+	emit({ 0x3B, 0x0A });                       // cmp ecx, [rdx]
+	bail_jumps.push_back(jump(0xF));            // jg
+	emit({ 0x48, 0xB8 });
+	emit64((uint64_t)parent.stack_limit_address());
+	emit({ 0x48, 0x8B, 0x00, 0x48, 0x39, 0xC4 }); // mov rax, [rax]; cmp rsp, rax
+	bail_jumps.push_back(jump(0x2));            // jb
+	
+	for (int i = 0; i < nparams; i++)
+	{
+		emit({ 0xF2, 0x0F, 0x10, 0x87 });        // movsd xmm0, [rdi + disp]
+		emit32(8 * (nparams - 1 - i));
+		store(param_disp(i), 0);
+	}
+	emit({ 0x48, 0x89, 0xB5 });                 // mov [rbp + out], rsi
+	emit32(out_disp());
+	
+	dispatch = buf.size();
+	for (auto& b : bodies)
+	{
+		std::vector<int> next;
+		slot_kinds.assign(b->cache_size, jit_function::kind_unknown);
+		
+		if (b->cache_size > 0)
+		{
+			emit({ 0x66, 0x0F, 0x57, 0xC0 });   // xorpd xmm0, xmm0
+			for (int s = 0; s < b->cache_size; s++)
+				store(flag_disp(s), 0);
+		}
+		
+		for (int i = 0; i < nparams; i++)
+		{
+			auto& cond = b->params.condition(i);
+			if (cond == nullptr)
+				continue;
+			if (!cond->compile_native(*this, false))
+				return false;
+			test_false(next);
+		}
+		
+		if (!b->body->compile_native(*this, true) || last != result || depth != 0)
+			return false;
+		
+		// *out = xmm0; return 0
+		emit({ 0x48, 0x8B, 0x85 });
+		emit32(out_disp());
+		emit({ 0xF2, 0x0F, 0x11, 0x00 });
+		leave_call();
+		emit({ 0x31, 0xC0, 0xC9, 0xC3 });   // xor eax, eax; leave; ret
+		
+		jumps_here(next);
+	}
+	
+	// no overload, or bailed out: return 1
+	jumps_here(bail_jumps);
+	leave_call();
+	emit({ 0xB8, 0x01, 0x00, 0x00, 0x00, 0xC9, 0xC3 });
+	return true;
+#endif
+}
+
+
+
+
+
+
+bool jit_builder::constant (const value& v)
+{
+	if (v.type == value::type_number)
+	{
+		load_number(0, v.num);
+		last = jit_function::kind_number;
+	}
+	else if (v.type == value::type_bool)
+	{
+		load_number(0, v.cond ? 1 : 0);
+		last = jit_function::kind_bool;
+	}
+	else
+		return false;
+	return true;
+}
+
+bool jit_builder::local (int index, int depth)
+{
+	if (depth != 0 || index < 0 || index >= nparams)
+		return false;
+	
+	load(0, param_disp(index));
+	last = jit_function::kind_number;
+	return true;
+}
+
+bool jit_builder::slot (int s)
+{
+	if (s >= (int)slot_kinds.size() || slot_kinds[s] == jit_function::kind_unknown)
+		return false;
+	
+	load(0, slot_disp(s));
+	last = slot_kinds[s];
+	return true;
+}
+
+bool jit_builder::bind_slot (int s, expression& val)
+{
+	if (s >= (int)slot_kinds.size() || !val.compile_native(*this, false))
+		return false;
+	
+	store(slot_disp(s), 0);
+	slot_kinds[s] = last;
+	return true;
+}
+
+bool jit_builder::cached (int s, expression& e)
+{
+	if (s >= (int)slot_kinds.size())
+		return false;
+	
+	// if (flag != 0) xmm0 = slot; else { xmm0 = e; slot = xmm0; flag = 1 }
+	load(0, flag_disp(s));
+	std::vector<int> compute, done;
+	test_false(compute);
+	load(0, slot_disp(s));
+	done.push_back(jump());
+	
+	jumps_here(compute);
+	if (!e.compile_native(*this, false))
+		return false;
+	store(slot_disp(s), 0);
+	load_number(1, 1);
+	store(flag_disp(s), 1);
+	jumps_here(done);
+	
+	slot_kinds[s] = last;
+	return true;
+}
+
+bool jit_builder::unary (int op, expression& a)
+{
+	if (!a.compile_native(*this, false))
+		return false;
+	
+	switch (op)
+	{
+	case '-':
+		if (last != jit_function::kind_number)
+			return false;
+		emit({ 0x48, 0xB8 });
+		emit64(0x8000000000000000ULL);
+		emit({ 0x66, 0x48, 0x0F, 0x6E, 0xC8,    // movq xmm1, rax
+		       0x66, 0x0F, 0x57, 0xC1 });       // xorpd xmm0, xmm1
+		return true;
+	
+	case '!':
+		// xmm0 = (xmm0 == 0)
+		emit({ 0x66, 0x0F, 0x57, 0xC9,          // xorpd xmm1, xmm1
+		       0x66, 0x0F, 0x2E, 0xC1,          // ucomisd xmm0, xmm1
+		       0x0F, 0x94, 0xC0,                // sete al
+		       0x0F, 0x9B, 0xC1,                // setnp cl
+		       0x20, 0xC8,                      // and al, cl
+		       0x0F, 0xB6, 0xC0,                // movzx eax, al
+		       0xF2, 0x0F, 0x2A, 0xC0 });       // cvtsi2sd xmm0, eax
+		last = jit_function::kind_bool;
+		return true;
+	
+	default:
+		return false;
+	}
+}
+
+static double power (double x, double y)
+{
+	return pow(x, y);
+}
+
+bool jit_builder::binary (int op, expression& a, expression& b, bool tail)
+{
+	if (op == lexer::token::keyword_and ||
+			op == lexer::token::keyword_or)
+	{
+		if (!a.compile_native(*this, false))
+			return false;
+		auto ka = last;
+		
+		std::vector<int> done;
+		if (op == lexer::token::keyword_and)
+			test_false(done);
+		else
+			test_true(done);
+		
+		if (!b.compile_native(*this, tail) || last != ka)
+			return false;
+		jumps_here(done);
+		return true;
+	}
+	
+	if (!a.compile_native(*this, false))
+		return false;
+	auto ka = last;
+	push();
+	if (!b.compile_native(*this, false))
+		return false;
+	auto kb = last;
+	
+	emit({ 0xF2, 0x0F, 0x10, 0xC8 });           // movsd xmm1, xmm0
+	pop(0);
+	
+	if (ka != kb || (ka != jit_function::kind_number && op != lexer::token::eql_token))
+		return false;
+	
+	int cc;
+	switch (op)
+	{
+	case '+': emit({ 0xF2, 0x0F, 0x58, 0xC1 }); last = ka; return true;
+	case '-': emit({ 0xF2, 0x0F, 0x5C, 0xC1 }); last = ka; return true;
+	case '*': emit({ 0xF2, 0x0F, 0x59, 0xC1 }); last = ka; return true;
+	
+	case '/': case '%':
+		// division by zero is left to the interpreter's error
+		emit({ 0x66, 0x0F, 0x57, 0xD2,          // xorpd xmm2, xmm2
+		       0x66, 0x0F, 0x2E, 0xCA,          // ucomisd xmm1, xmm2
+		       0x7A, 0x06 });                   // jp over the je
+		bail_jumps.push_back(jump(0x4));
+		
+		if (op == '/')
+			emit({ 0xF2, 0x0F, 0x5E, 0xC1 });   // divsd xmm0, xmm1
+		else
+			emit({ 0xF2, 0x0F, 0x10, 0xD0,      // movsd xmm2, xmm0
+			       0xF2, 0x0F, 0x5E, 0xD1,      // divsd xmm2, xmm1
+			       0xF2, 0x0F, 0x2C, 0xC2,      // cvttsd2si eax, xmm2
+			       0xF2, 0x0F, 0x2A, 0xD0,      // cvtsi2sd xmm2, eax
+			       0xF2, 0x0F, 0x59, 0xD1,      // mulsd xmm2, xmm1
+			       0xF2, 0x0F, 0x5C, 0xC2 });   // subsd xmm0, xmm2
+		last = ka;
+		return true;
+	
+	case '^':
+		align_call(true);
+		call_address((const void*)(&power));
+		align_call(false);
+		last = ka;
+		return true;
+	
+	// as in value::apply_operator, where a NaN is neither equal nor greater
+	case '>':                     cc = 0x7; break; // seta
+	case '<':                     cc = 0x2; break; // setb
+	case lexer::token::gre_token: cc = 0x3; break; // setae
+	case lexer::token::lse_token: cc = 0x6; break; // setbe
+	case lexer::token::eql_token: cc = 0x4; break; // sete, and setnp
+	default:
+		return false;
+	}
+	
+	emit({ 0x66, 0x0F, 0x2E, 0xC1,              // ucomisd xmm0, xmm1
+	       0x0F, (unsigned char)(0x90 | cc), 0xC0 });
+	if (op == lexer::token::eql_token)
+		emit({ 0x0F, 0x9B, 0xC1, 0x20, 0xC8 }); // setnp cl; and al, cl
+	emit({ 0x0F, 0xB6, 0xC0,                    // movzx eax, al
+	       0xF2, 0x0F, 0x2A, 0xC0 });           // cvtsi2sd xmm0, eax
+	last = jit_function::kind_bool;
+	return true;
+}
+
+// arguments are pushed in order, leaving the last one lowest in memory
+bool jit_builder::number_args (const child_values& args)
+{
+	for (auto& a : args)
+	{
+		if (!a->compile_native(*this, false) ||
+				last != jit_function::kind_number)
+			return false;
+		push();
+	}
+	return true;
+}
+
+// the compiled code of a function called from this one
+jit_function* jit_builder::target (soft_function* f)
+{
+	if (f->jit_disabled)
+		return nullptr;
+	if (f->jit_code == nullptr && busy.count(f) == 0)
+	{
+		f->jit_code = jit_function::compile(*f, parent, busy);
+		if (f->jit_code == nullptr)
+			f->jit_disabled = true;
+	}
+	return f->jit_code.get();
+}
+
+static int call_native (function* f, const double* last, int n, double* out, state* s)
+{
+	argument_list args(n);
+	for (int i = 0; i < n; i++)
+		args.values[i] = value::from_number(last[n - 1 - i]);
+	
+	value result;
+	state::scope scope(*s);
+	if (!f->call(result, args, scope))
+	{
+		s->error().flush();
+		return 1;
+	}
+	if (result.type != value::type_number)
+		return 1;
+	
+	*out = result.num;
+	return 0;
+}
+
+bool jit_builder::call (expression& callee, const child_values& args, bool tail)
+{
+	auto v = callee.const_value();
+	if (v == nullptr)
+		return false;
+	
+	int n = args.size();
+	
+	// 'c(x)' multiplies
+	if (v->type == value::type_number)
+	{
+		if (n != 1 || !args[0]->compile_native(*this, false) ||
+				last != jit_function::kind_number)
+			return false;
+		load_number(1, v->num);
+		emit({ 0xF2, 0x0F, 0x59, 0xC1 });       // mulsd xmm0, xmm1
+		return true;
+	}
+	if (v->type != value::type_function)
+		return false;
+	
+	auto f = v->func_obj.get();
+	bool self = (f == &func);
+	
+	if (f->is_native() && f->purity() != function::purity_pure)
+		return false;
+	if (!f->is_native() && static_cast<soft_function*>(f)->memo() != nullptr)
+		return false;
+	
+	// self tail calls jump back to the guards with new parameters
+	if (self && tail)
+	{
+		if (n != nparams || depth != 0 || !number_args(args))
+			return false;
+		
+		for (int i = n; i-- > 0; )
+		{
+			pop(0);
+			store(param_disp(i), 0);
+		}
+		patch(jump(), dispatch);
+		last = result;
+		return true;
+	}
+	
+	jit_function* code = nullptr;
+	if (!f->is_native() && !self)
+	{
+		code = target(static_cast<soft_function*>(f));
+		if (code == nullptr || code->params() != n)
+			return false;
+	}
+	else if (self && n != nparams)
+		return false;
+	
+	if (!number_args(args))
+		return false;
+	
+	// result slot, then padding so that rsp is 16 byte aligned
+	emit({ 0x48, 0x83, 0xEC, 0x08 });
+	depth++;
+	int pad = depth % 2;
+	if (pad)
+		emit({ 0x48, 0x83, 0xEC, 0x08 });
+	
+	if (f->is_native())
+	{
+		emit({ 0x48, 0xBF });                   // mov rdi, f
+		emit64((uint64_t)f);
+		emit({ 0x48, 0x8D, 0xB4, 0x24 });       // lea rsi, [rsp + last arg]
+		emit32(8 * (pad + 1));
+		emit({ 0xBA });                         // mov edx, n
+		emit32(n);
+		emit({ 0x48, 0x8D, 0x8C, 0x24 });       // lea rcx, [rsp + result]
+		emit32(8 * pad);
+		emit({ 0x49, 0xB8 });                   // mov r8, state
+		emit64((uint64_t)&parent);
+		call_address((const void*)(&call_native));
+		last = jit_function::kind_number;
+	}
+	else
+	{
+		emit({ 0x48, 0x8D, 0xBC, 0x24 });       // lea rdi, [rsp + last arg]
+		emit32(8 * (pad + 1));
+		emit({ 0x48, 0x8D, 0xB4, 0x24 });       // lea rsi, [rsp + result]
+		emit32(8 * pad);
+		if (self)
+		{
+			call_self();
+			last = result;
+		}
+		else
+		{
+			call_address(code->entry());
+			last = code->result();
+		}
+	}
+	
+	emit({ 0x85, 0xC0 });                       // test eax, eax
+	bail_jumps.push_back(jump(0x5));            // jne
+	
+	emit({ 0xF2, 0x0F, 0x10, 0x84, 0x24 });     // movsd xmm0, [rsp + result]
+	emit32(8 * pad);
+	emit({ 0x48, 0x81, 0xC4 });                 // add rsp, ...
+	emit32(8 * (pad + 1 + n));
+	depth -= 1 + n;
+	return true;
+}
+
+
+
+
+
+
+void jit_builder::emit (std::initializer_list<unsigned char> bytes)
+{
+	buf.insert(buf.end(), bytes);
+}
+void jit_builder::emit32 (int32_t n)
+{
+	for (int i = 0; i < 4; i++)
+		buf.push_back((unsigned char)(n >> (8 * i)));
+}
+void jit_builder::emit64 (uint64_t n)
+{
+	for (int i = 0; i < 8; i++)
+		buf.push_back((unsigned char)(n >> (8 * i)));
+}
+
+// 'jmp', or 'jcc' for condition code 'cc'; returns where to patch
+int jit_builder::jump (int cc)
+{
+	if (cc < 0)
+		emit({ 0xE9 });
+	else
+		emit({ 0x0F, (unsigned char)(0x80 | cc) });
+	emit32(0);
+	return buf.size() - 4;
+}
+void jit_builder::patch (int at, int target)
+{
+	int32_t rel = target - (at + 4);
+	memcpy(&buf[at], &rel, 4);
+}
+void jit_builder::jumps_here (const std::vector<int>& at)
+{
+	for (int j : at)
+		patch(j, buf.size());
+}
+
+// movsd xmm, [rbp + disp] / movsd [rbp + disp], xmm
+void jit_builder::load (int xmm, int disp)
+{
+	emit({ 0xF2, 0x0F, 0x10, (unsigned char)(0x85 | (xmm << 3)) });
+	emit32(disp);
+}
+void jit_builder::store (int disp, int xmm)
+{
+	emit({ 0xF2, 0x0F, 0x11, (unsigned char)(0x85 | (xmm << 3)) });
+	emit32(disp);
+}
+void jit_builder::load_number (int xmm, number n)
+{
+	uint64_t bits;
+	memcpy(&bits, &n, 8);
+	emit({ 0x48, 0xB8 });                       // mov rax, bits
+	emit64(bits);
+	emit({ 0x66, 0x48, 0x0F, 0x6E, (unsigned char)(0xC0 | (xmm << 3)) });
+}
+
+void jit_builder::push ()
+{
+	emit({ 0x48, 0x83, 0xEC, 0x08,              // sub rsp, 8
+	       0xF2, 0x0F, 0x11, 0x04, 0x24 });     // movsd [rsp], xmm0
+	depth++;
+}
+void jit_builder::pop (int xmm)
+{
+	emit({ 0xF2, 0x0F, 0x10, (unsigned char)(0x04 | (xmm << 3)), 0x24,
+	       0x48, 0x83, 0xC4, 0x08 });           // add rsp, 8
+	depth--;
+}
+
+// jumps when xmm0 is false (zero), or true (non-zero, including NaN)
+void jit_builder::test_false (std::vector<int>& to)
+{
+	emit({ 0x66, 0x0F, 0x57, 0xC9,              // xorpd xmm1, xmm1
+	       0x66, 0x0F, 0x2E, 0xC1,              // ucomisd xmm0, xmm1
+	       0x7A, 0x06 });                       // jp over the je
+	to.push_back(jump(0x4));
+}
+void jit_builder::test_true (std::vector<int>& to)
+{
+	emit({ 0x66, 0x0F, 0x57, 0xC9,
+	       0x66, 0x0F, 0x2E, 0xC1 });
+	to.push_back(jump(0xA));                    // jp
+	to.push_back(jump(0x5));                    // jne
+}
+
+void jit_builder::call_address (const void* f)
+{
+	emit({ 0x48, 0xB8 });                       // mov rax, f
+	emit64((uint64_t)f);
+	emit({ 0xFF, 0xD0 });                       // call rax
+}
+void jit_builder::call_self ()
+{
+	emit({ 0xE8 });
+	emit32(0);
+	patch(buf.size() - 4, 0);
+}
+void jit_builder::leave_call ()
+{
+	emit({ 0x48, 0xB9 });                       // mov rcx, &depth
+	emit64((uint64_t)parent.depth_address());
+	emit({ 0xFF, 0x09 });                       // dec [rcx]
+}
+void jit_builder::align_call (bool before)
+{
+	if (depth % 2 == 0)
+		return;
+	if (before)
+		emit({ 0x48, 0x83, 0xEC, 0x08 });
+	else
+		emit({ 0x48, 0x83, 0xC4, 0x08 });
+}
+
+
+
+};
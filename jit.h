@@ -0,0 +1,119 @@
+#pragma once
+#include "state.h"
+#include "value.h"
+
+#include <set>
+
+namespace xy {
+
+class expression;
+class soft_function;
+typedef std::vector<std::shared_ptr<expression>> child_values;
+
+
+// machine code for a soft function called with numbers only; x86-64 linux
+// only, elsewhere nothing is ever compiled
+class jit_function
+{
+public:
+	// what the code returns, and what temporaries hold: both are kept as
+	// doubles in the machine code, bools as 0 or 1
+	enum kind
+	{
+		kind_number,
+		kind_bool,
+		kind_unknown
+	};
+	
+	~jit_function ();
+	
+	// false if the code bailed out (any case it doesn't cover, such as a
+	// division by zero or no matching overload), and the call should be
+	// interpreted instead
+	bool run (value& out, const value* args);
+	
+	inline int params () const { return nparams; }
+	inline kind result () const { return result_kind; }
+	inline const void* entry () const { return code; }
+	
+	static std::shared_ptr<jit_function> compile (soft_function& f, state& s);
+
+private:
+	friend class jit_builder;
+	jit_function ();
+	
+	// 'busy' holds the functions being compiled, whose callers fail
+	static std::shared_ptr<jit_function> compile (soft_function& f, state& s,
+			std::set<soft_function*>& busy);
+	
+	void* code;
+	size_t code_size;
+	int nparams;
+	kind result_kind;
+};
+
+
+// emits the code of one soft function; expressions compile themselves
+// through the methods below (see expression::compile_native), which leave
+// their value in xmm0
+class jit_builder
+{
+public:
+	bool constant (const value& v);
+	bool local (int index, int depth);
+	bool slot (int s);
+	bool bind_slot (int s, expression& val);
+	bool cached (int s, expression& e);
+	bool unary (int op, expression& a);
+	bool binary (int op, expression& a, expression& b, bool tail);
+	bool call (expression& callee, const child_values& args, bool tail);
+
+private:
+	friend class jit_function;
+	jit_builder (soft_function& f, state& s, std::set<soft_function*>& busy,
+			jit_function::kind result);
+	
+	soft_function& func;
+	state& parent;
+	std::set<soft_function*>& busy;
+	
+	std::vector<unsigned char> buf;
+	int nparams, nslots;
+	int depth;                  // 8 byte temporaries on the machine stack
+	int dispatch;               // offset of the first overload's guards
+	jit_function::kind last;    // kind of the last compiled expression
+	jit_function::kind result;
+	std::vector<jit_function::kind> slot_kinds;
+	std::vector<int> bail_jumps;
+	
+	bool build ();
+	bool number_args (const child_values& args);
+	jit_function* target (soft_function* f);
+	
+	// assembler
+	void emit (std::initializer_list<unsigned char> bytes);
+	void emit32 (int32_t n);
+	void emit64 (uint64_t n);
+	int jump (int cc = -1);
+	void patch (int at, int target);
+	void jumps_here (const std::vector<int>& at);
+	void load (int xmm, int disp);
+	void store (int disp, int xmm);
+	void load_number (int xmm, number n);
+	void push ();
+	void pop (int xmm);
+	void test_false (std::vector<int>& to);
+	void test_true (std::vector<int>& to);
+	void call_address (const void* f);
+	void call_self ();
+	void align_call (bool before);
+	void leave_call ();
+	
+	int param_disp (int i) const;
+	int out_disp () const;
+	int slot_disp (int s) const;
+	int flag_disp (int s) const;
+};
+
+
+};
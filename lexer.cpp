@@ -9,7 +9,7 @@ namespace xy {
 
 
 
-std::vector<std::string> lexer::token::keywords
+const std::vector<std::string> lexer::token::keywords
 {
 	"let", "with", "use",
 	value::true_string(), value::false_string(),
@@ -17,7 +17,7 @@ std::vector<std::string> lexer::token::keywords
 	"hd", "tl"
 };
 
-std::vector<lexer::token::two_char> lexer::token::two_chars =
+const std::vector<lexer::token::two_char> lexer::token::two_chars =
 {
 	two_char("..", seq_token),
 	two_char("==", eql_token),
@@ -25,7 +25,8 @@ std::vector<lexer::token::two_char> lexer::token::two_chars =
 	two_char(">=", gre_token),
 	two_char("<=", lse_token),
 	two_char("->", rarr_token),
-	two_char("::", box_token)
+	two_char("::", box_token),
+	two_char("$$", plcomp_token)
 };
 
 
@@ -37,6 +37,7 @@ public:
 			lse_token,
 			rarr_token,
 			box_token,
+			plcomp_token,
 			
 			keyword__start = 2000,
 			keyword_let = keyword__start,
@@ -72,8 +73,8 @@ public:
 			std::string str () const;
 		};
 		
-		static std::vector<std::string> keywords;
-		static std::vector<two_char> two_chars;
+		static const std::vector<std::string> keywords;
+		static const std::vector<two_char> two_chars;
 		
 		static inline std::string eof_string () { return "<eof>"; }
 		static inline std::string number_string () { return "<number>"; }
@@ -8,10 +8,10 @@ namespace xy {
 
 #define XY_LIST_DUPLICATE_LENGTH 8
 
-std::shared_ptr<list> list::empty_list(new list());
+const std::shared_ptr<list> list::empty_list(new list());
 
 
-list::list () : is_sublist(false) {}
+list::list () : is_sublist(false), is_concat(false) {}
 list::~list () {}
 
 
@@ -58,7 +58,7 @@ std::shared_ptr<list> list::sublist (const std::shared_ptr<list>& a, int index)
 	if (index >= 0 && a->is_sublist)
 	{
 		auto b = std::static_pointer_cast<list_sublist>(a);
-		if (b->end == b->size())
+		if (b->end == b->a->size())
 		{
 			return sublist(b->a, index + b->start);
 		}
@@ -83,6 +83,13 @@ std::shared_ptr<list> list::basic (const std::vector<value>& values)
 	else
 		return std::shared_ptr<list>(new list_basic(values));
 }
+std::shared_ptr<list> list::basic (std::vector<value>&& values)
+{
+	if (values.size() == 0)
+		return empty();
+	else
+		return std::shared_ptr<list>(new list_basic(std::move(values)));
+}
 
 
 
@@ -95,6 +102,10 @@ list_basic::list_basic (const std::vector<value>& values)
 	: vals(values)
 { }
 
+list_basic::list_basic (std::vector<value>&& values)
+	: vals(std::move(values))
+{ }
+
 list_basic::list_basic (const std::initializer_list<value>& values)
 {
 	for (auto v : values)
@@ -148,20 +159,35 @@ value list_sublist::get (int i)
 
 
 list_concat::list_concat (const std::shared_ptr<list>& a, const std::shared_ptr<list>& b)
-	: head(a), tail(b)
-{ }
+	: head(a), tail(b), head_size(a->size()), total_size(head_size + b->size())
+{
+	is_concat = true;
+}
 
 int list_concat::size ()
 {
-	return head->size() + tail->size();
+	return total_size;
 }
 value list_concat::get (int i)
 {
-	int hs = head->size();
-	if (i >= hs)
-		return tail->get(i - hs);
-	else
-		return head->get(i);
+	// walk down nested concatenations iteratively; recursive lists can
+	// build chains as long as the list itself
+	list_concat* c = this;
+	for (;;)
+	{
+		list* next;
+		if (i >= c->head_size)
+		{
+			i -= c->head_size;
+			next = c->tail.get();
+		}
+		else
+			next = c->head.get();
+		
+		if (!next->is_concat)
+			return next->get(i);
+		c = static_cast<list_concat*>(next);
+	}
 }
 
 
@@ -23,11 +23,14 @@ public:
 	static std::shared_ptr<list> concat (const std::shared_ptr<list>& a, const std::shared_ptr<list>& b);
 	static std::shared_ptr<list> sublist (const std::shared_ptr<list>& a, int index);
 	static std::shared_ptr<list> basic (const std::vector<value>& values);
+	static std::shared_ptr<list> basic (std::vector<value>&& values);
 private:
-	static std::shared_ptr<list> empty_list;
+	static const std::shared_ptr<list> empty_list;
 	
 protected:
-	bool is_sublist;
+	bool is_sublist, is_concat;
+	
+	friend class list_concat;
 };
 
 
@@ -36,6 +39,7 @@ class list_basic
 {
 public:
 	list_basic (const std::vector<value>& values);
+	list_basic (std::vector<value>&& values);
 	list_basic (const std::initializer_list<value>& values);
 	
 	virtual ~list_basic ();
@@ -72,6 +76,7 @@ public:
 	virtual value get (int i);
 private:
 	std::shared_ptr<list> head, tail;
+	int head_size, total_size;
 };
 
 
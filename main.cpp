@@ -4,6 +4,9 @@
 #include "function.h"
 #include "value.h"
 #include "list.h"
+#include "translate.h"
+#include "server.h"
+#include "embed.h"
 
 
 #define XY_VERSION "version 0.9.2 beta (c++11 build)"
@@ -17,7 +20,21 @@ static int help_text ()
 	std::cout << "usage:  xy [flags] PROGRAM [program arguments]\n"
 	             //"\n"
 				 "   --version          display version info\n"
-				 "   -h, --help         show this help text\n";
+				 "   -h, --help         show this help text\n"
+				 "   --max-depth N      fail after N nested function calls\n"
+				 "   --stack-size MB    size of the evaluation stack, in megabytes\n"
+				 "   --engine=NAME      evaluate with 'tree' (default) or 'vm'\n"
+				 "   --jit              compile numeric functions to machine code\n"
+				 "   --threads N        threads for 'pmap' and 'pfilter' (default: all cores)\n"
+				 "   --type-stats       report how many expressions have a proven type\n"
+				 "   --emit-cpp         write the program as C++ (see 'make native')\n"
+				 "   --each-line        call 'line(s)' for every line of the input, writing\n"
+				 "                      the results that are not void, one per line\n"
+				 "   --batch N          with --each-line, pass lists of N lines instead,\n"
+				 "                      writing the items of list results one per line\n"
+				 "   --serve SOCKET     answer requests on a unix socket with 'handle(req)'\n"
+				 "   --request SOCKET TEXT\n"
+				 "                      send TEXT to a server and print its reply\n";
 	return 0;
 }
 
@@ -30,6 +47,64 @@ static int version_info ()
 }
 
 
+// streams the standard input through the function 'line', a line or a
+// list of 'batch' lines at a time, keeping only the current ones
+static bool each_line (xy::state& xy, int batch)
+{
+	xy::prepared_function line_func(xy, "line");
+	if (!line_func.found())
+	{
+		xy.error().die() << "no line function found";
+		return false;
+	}
+	
+	std::ios::sync_with_stdio(false);
+	std::cin.tie(nullptr);
+	
+	std::vector<xy::value> lines;
+	std::string text;
+	long count = 0;
+	bool more = true;
+	
+	while (more)
+	{
+		more = (bool)(std::getline(std::cin, text));
+		if (more)
+		{
+			lines.push_back(xy::value::from_string(text));
+			count++;
+			if ((int)(lines.size()) < batch)
+				continue;
+		}
+		if (lines.size() == 0)
+			break;
+		
+		xy::value input = batch > 0 ?
+			xy::value::from_list(xy::list::basic(std::move(lines))) : lines[0];
+		lines.clear();
+		
+		xy::value output;
+		if (!line_func.call(output, &input, 1))
+		{
+			std::string message(xy.error().flush());
+			xy.error().die() << message << " (at input line " << count << ")";
+			return false;
+		}
+		
+		if (batch > 0 && output.type == xy::value::type_list)
+		{
+			for (int i = 0, size = output.list_size(); i < size; i++)
+				std::cout << output.list_get(i).to_str() << '\n';
+		}
+		else if (output.type != xy::value::type_void)
+			std::cout << output.to_str() << '\n';
+	}
+	
+	std::cout.flush();
+	return true;
+}
+
+
 int main (int argc, char** argv)
 {
 	if (argc <= 1)
@@ -39,8 +114,13 @@ int main (int argc, char** argv)
 	xy::state xy;
 	
 	int start;
+	bool emit_cpp = false;
+	bool type_stats = false;
+	std::string serve_path;
+	bool streaming = false;
+	int batch = 0;
 	
-	for (start = 1; start <= argc; start++)
+	for (start = 1; start < argc; start++)
 	{
 		std::string arg(argv[start]);
 		
@@ -48,35 +128,122 @@ int main (int argc, char** argv)
 			return version_info();
 		else if (arg == "-h" || arg == "--help")
 			return help_text();
+		else if (arg == "--max-depth" && start + 1 < argc)
+		{
+			int depth = std::atoi(argv[++start]);
+			if (depth <= 0)
+			{
+				std::cerr << "--max-depth must be a positive number of calls" << std::endl;
+				return -1;
+			}
+			xy.set_max_depth(depth);
+		}
+		else if (arg == "--stack-size" && start + 1 < argc)
+		{
+			long size = std::atol(argv[++start]);
+			if (size <= 0)
+			{
+				std::cerr << "--stack-size must be a positive number of megabytes" << std::endl;
+				return -1;
+			}
+			xy.set_stack_size((size_t)(size) << 20);
+		}
+		else if (arg == "--engine=tree")
+			xy.set_engine(xy::state::engine_tree);
+		else if (arg == "--engine=vm")
+			xy.set_engine(xy::state::engine_vm);
+		else if (arg == "--jit")
+			xy.set_jit(true);
+		else if (arg == "--threads" && start + 1 < argc)
+		{
+			int threads = std::atoi(argv[++start]);
+			if (threads <= 0)
+			{
+				std::cerr << "--threads must be a positive number of threads" << std::endl;
+				return -1;
+			}
+			xy.set_threads(threads);
+		}
+		else if (arg == "--emit-cpp")
+			emit_cpp = true;
+		else if (arg == "--type-stats")
+			type_stats = true;
+		else if (arg == "--each-line")
+			streaming = true;
+		else if (arg == "--batch" && start + 1 < argc)
+		{
+			batch = std::atoi(argv[++start]);
+			if (batch <= 0)
+			{
+				std::cerr << "--batch must be a positive number of lines" << std::endl;
+				return -1;
+			}
+		}
+		else if (arg == "--serve" && start + 1 < argc)
+			serve_path = argv[++start];
+		else if (arg == "--request" && start + 2 < argc)
+		{
+			std::string reply;
+			bool ok;
+			if (!xy::server::request(reply, ok, argv[start + 1], argv[start + 2], xy))
+				goto fail;
+			(ok ? std::cout : std::cerr) << reply << std::endl;
+			return ok ? 0 : -1;
+		}
 		else
 			break;
 	}
 	
-	if (!xy.load(std::string(argv[start])))
-		goto fail;
+	if (start >= argc)
+		return help_text();
+	
+	if (batch > 0 && !streaming)
+	{
+		std::cerr << "--batch only applies with --each-line" << std::endl;
+		return -1;
+	}
 	
+	if (!xy.run([&] () -> bool
 	{
-		auto main_func = xy.global().find_function("main");
-		if (main_func != nullptr)
+		if (!xy.load(std::string(argv[start])))
+			return false;
+		xy.seal();
+		
+		if (type_stats)
+		{
+			int n = xy.typed_nodes(), p = xy.proven_nodes();
+			std::cerr << "proven types: " << p << " of " << n << " expressions ("
+			          << (n == 0 ? 0 : 100 * p / n) << "%)" << std::endl;
+		}
+		
+		if (emit_cpp)
+			return xy::cpp_writer::translate(xy, std::string(argv[start]), std::cout);
+		
+		if (serve_path.size() > 0)
+			return xy::server(xy, serve_path).run();
+		
+		if (streaming)
+			return each_line(xy, batch);
+		
+		xy::prepared_function main_func(xy, "main");
+		if (main_func.found())
 		{
-			xy::state::scope scope(xy);
 			xy::value output;
 			
 			std::vector<xy::value> arg_strings;
 			for (int i = start + 1; i < argc; i++)
 				arg_strings.push_back(xy::value::from_string(std::string(argv[i])));
 			
-			xy::argument_list args
-				{
-					xy::value::from_list(xy::list::basic(arg_strings))
-				};
-			
-			if (!main_func->call(output, args, scope))
-				goto fail;
+			xy::value args(xy::value::from_list(xy::list::basic(arg_strings)));
+			if (!main_func.call(output, &args, 1))
+				return false;
 		}
 		else
 			std::cout << "no main function found" << std::endl;
-	}
+		
+		return true;
+	}))
+		goto fail;
 	
 	return 0;
 	
@@ -52,6 +52,15 @@ map::hash map::get_hash (const std::string& key)
 	return k;
 }
 
+void map::entries (std::vector<hash>& ks, std::vector<value>& vs) const
+{
+	for (int i = 0; i < size; i++)
+	{
+		ks.push_back(keys[i]);
+		vs.push_back(values[i]);
+	}
+}
+
 bool map::contains (hash key) const
 {
 	return index(key) >= 0;
@@ -75,6 +84,27 @@ bool map::set (hash key, const value& v)
 	else
 		return false;
 }
+bool map::same_key (const std::shared_ptr<map>& other, state& eval_state) const
+{
+	if (size != other->size)
+		return false;
+	
+	for (int i = 0; i < size; i++)
+	{
+		int j = other->index(keys[i]);
+		if (j < 0 || !values[i].same_key(other->values[j], eval_state))
+			return false;
+	}
+	return true;
+}
+map::hash map::hash_code () const
+{
+	// independent of key order, like same_key()
+	hash h = 0;
+	for (int i = 0; i < size; i++)
+		h += (keys[i] ^ values[i].hash_code()) * 1099511628211ULL;
+	return h;
+}
 int map::index (hash key) const
 {
 	for (int i = 0; i < size; i++)
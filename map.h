@@ -19,6 +19,11 @@ public:
 	value get (hash key) const;
 	bool set (hash key, const value& v);
 	
+	bool same_key (const std::shared_ptr<map>& other, state& eval_state) const;
+	hash hash_code () const;
+	// the keys and values, in no particular order
+	void entries (std::vector<hash>& ks, std::vector<value>& vs) const;
+	
 	static hash get_hash (const std::string& key);
 	static std::shared_ptr<map> empty ();
 	static std::shared_ptr<map> create (const std::vector<hash>& keys,
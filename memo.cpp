@@ -0,0 +1,75 @@
+#include "include.h"
+#include "memo.h"
+#include "function.h"
+
+namespace xy {
+
+
+
+memo_table::memo_table (int cap)
+	: max_size(cap < 1 ? 1 : cap), hit_count(0), miss_count(0)
+{ }
+
+
+uint64_t memo_table::hash_args (const argument_list& args)
+{
+	uint64_t h = (uint64_t)(args.size);
+	for (int i = 0; i < args.size; i++)
+		h = (h ^ args.values[i].hash_code()) * 1099511628211ULL;
+	return h;
+}
+bool memo_table::same_args (entry& e, const argument_list& args, state& s)
+{
+	if ((int)(e.args.size()) != args.size)
+		return false;
+	
+	for (int i = 0; i < args.size; i++)
+		if (!e.args[i].same_key(args.values[i], s))
+			return false;
+	return true;
+}
+
+
+bool memo_table::find (const argument_list& args, value& out, state& s)
+{
+	uint64_t h = hash_args(args);
+	std::lock_guard<std::mutex> l(lock);
+	
+	auto range = index.equal_range(h);
+	for (auto it = range.first; it != range.second; it++)
+		if (same_args(*it->second, args, s))
+		{
+			// move to the front of the list
+			entries.splice(entries.begin(), entries, it->second);
+			out = it->second->result;
+			hit_count++;
+			return true;
+		}
+	
+	miss_count++;
+	return false;
+}
+
+void memo_table::insert (const argument_list& args, const value& result, state& s)
+{
+	std::lock_guard<std::mutex> l(lock);
+	if ((int)(entries.size()) >= max_size)
+	{
+		auto last = std::prev(entries.end());
+		auto range = index.equal_range(last->hash);
+		for (auto it = range.first; it != range.second; it++)
+			if (it->second == last)
+			{
+				index.erase(it);
+				break;
+			}
+		entries.pop_back();
+	}
+	
+	entry e { hash_args(args), std::vector<value>(args.values, args.values + args.size), result };
+	entries.push_front(e);
+	index.insert(std::make_pair(e.hash, entries.begin()));
+}
+
+
+};
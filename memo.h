@@ -0,0 +1,52 @@
+#pragma once
+
+#include "value.h"
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace xy {
+
+#define XY_DEFAULT_MEMO_CAPACITY 16384
+
+struct argument_list;
+
+// bounded table of results of a pure function, indexed by the structural
+// hash of its arguments; least recently used entries are evicted first.
+// shared by the worker threads of parallel natives
+class memo_table
+{
+public:
+	memo_table (int capacity);
+	
+	bool find (const argument_list& args, value& out, state& s);
+	void insert (const argument_list& args, const value& result, state& s);
+	
+	inline int capacity () const { return max_size; }
+	inline int size () const { return (int)(entries.size()); }
+	inline long hits () const { return hit_count; }
+	inline long misses () const { return miss_count; }
+	
+private:
+	struct entry
+	{
+		uint64_t hash;
+		std::vector<value> args;
+		value result;
+	};
+	typedef std::list<entry>::iterator entry_it;
+	
+	static uint64_t hash_args (const argument_list& args);
+	static bool same_args (entry& e, const argument_list& args, state& s);
+	
+	int max_size;
+	long hit_count, miss_count;
+	
+	std::list<entry> entries; // most recently used first
+	std::unordered_multimap<uint64_t, entry_it> index;
+	std::mutex lock;
+};
+
+
+};
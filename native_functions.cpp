@@ -3,6 +3,13 @@
 #include "function.h"
 #include "value.h"
 #include "list.h"
+#include "map.h"
+#include "memo.h"
+#include "workers.h"
+#include "processes.h"
+
+#include <unordered_set>
+#include <unordered_map>
 
 namespace xy {
 
@@ -11,6 +18,214 @@ namespace xy {
 
 
 
+// the shape of the combination tree of 'reduce': lists are cut into at most
+// XY_REDUCE_LEAVES chunks of at least XY_REDUCE_MIN_CHUNK items, depending
+// only on their length, which are then combined in pairs, level by level
+#define XY_REDUCE_LEAVES     256
+#define XY_REDUCE_MIN_CHUNK  64
+
+static int reduce_chunk (int size)
+{
+	return std::max(XY_REDUCE_MIN_CHUNK, (size + XY_REDUCE_LEAVES - 1) / XY_REDUCE_LEAVES);
+}
+
+// combines adjacent partial results until one is left, an odd one out
+// moving up a level as it is
+template <typename T, typename Combine>
+static bool combine_tree (std::vector<T>& parts, state& s, const Combine& fn)
+{
+	while (parts.size() > 1)
+	{
+		int pairs = parts.size() / 2;
+		std::vector<T> up(pairs + parts.size() % 2);
+		if (!worker_pool::each(s, pairs, [&] (int i, state& ws)
+		{
+			return fn(up[i], parts[2 * i], parts[2 * i + 1], ws);
+		}))
+			return false;
+		
+		if (parts.size() % 2)
+			up.back() = parts.back();
+		parts.swap(up);
+	}
+	return true;
+}
+
+// 'reduce' over numbers with '+' or '*': each chunk in four interleaved
+// lanes, which the compiler can keep in vector registers
+static bool reduce_numbers (number& out, const std::vector<number>& xs, int op, state& s)
+{
+	int size = xs.size(), chunk = reduce_chunk(size);
+	std::vector<number> parts((size + chunk - 1) / chunk);
+	
+	auto apply = [op] (number a, number b) { return op == '+' ? a + b : a * b; };
+	if (!worker_pool::each(s, parts.size(), [&] (int c, state& ws)
+	{
+		int start = c * chunk, end = std::min(start + chunk, size);
+		number lanes[4];
+		for (int k = 0; k < 4; k++)
+			lanes[k] = op == '+' ? 0 : 1;
+		
+		int i = start;
+		if (op == '+')
+			for (; i + 4 <= end; i += 4)
+				for (int k = 0; k < 4; k++)
+					lanes[k] += xs[i + k];
+		else
+			for (; i + 4 <= end; i += 4)
+				for (int k = 0; k < 4; k++)
+					lanes[k] *= xs[i + k];
+		for (int k = 0; i < end; i++, k++)
+			lanes[k] = apply(lanes[k], xs[i]);
+		
+		parts[c] = apply(apply(lanes[0], lanes[1]), apply(lanes[2], lanes[3]));
+		return true;
+	}))
+		return false;
+	
+	if (!combine_tree(parts, s, [&] (number& r, number a, number b, state&)
+	{
+		r = apply(a, b);
+		return true;
+	}))
+		return false;
+	
+	out = parts[0];
+	return true;
+}
+
+// runs of this many items are sorted by insertion before being merged
+#define XY_SORT_RUN 32
+
+// stable merge sort of 'xs', where before(lt, a, b, s) tells whether 'a'
+// must come before 'b', and may fail. short runs are sorted first, and then
+// merged in pairs level by level; the runs, and the merges of a level, are
+// handed to the workers
+template <typename T, typename Before>
+static bool merge_sort (std::vector<T>& xs, state& s, const Before& before)
+{
+	int size = xs.size();
+	
+	// the right item only goes first if strictly before the left
+	if (!worker_pool::each(s, (size + XY_SORT_RUN - 1) / XY_SORT_RUN, [&] (int r, state& ws)
+	{
+		int start = r * XY_SORT_RUN, end = std::min(start + XY_SORT_RUN, size);
+		bool lt;
+		for (int i = start + 1; i < end; i++)
+		{
+			T x(xs[i]);
+			int j = i;
+			for (; j > start; j--)
+			{
+				if (!before(lt, x, xs[j - 1], ws))
+					return false;
+				if (!lt)
+					break;
+				xs[j] = xs[j - 1];
+			}
+			xs[j] = x;
+		}
+		return true;
+	}))
+		return false;
+	
+	std::vector<T> buffer(size);
+	std::vector<T>* from = &xs;
+	std::vector<T>* to = &buffer;
+	
+	for (int width = XY_SORT_RUN; width < size; width *= 2)
+	{
+		int pairs = (size + 2 * width - 1) / (2 * width);
+		if (!worker_pool::each(s, pairs, [&] (int p, state& ws)
+		{
+			int i = 2 * p * width, k = i;
+			int mid = std::min(i + width, size), end = std::min(i + 2 * width, size);
+			int j = mid;
+			
+			bool lt;
+			while (i < mid && j < end)
+			{
+				if (!before(lt, (*from)[j], (*from)[i], ws))
+					return false;
+				(*to)[k++] = lt ? (*from)[j++] : (*from)[i++];
+			}
+			while (i < mid)
+				(*to)[k++] = (*from)[i++];
+			while (j < end)
+				(*to)[k++] = (*from)[j++];
+			return true;
+		}))
+			return false;
+		
+		std::swap(from, to);
+	}
+	
+	if (from != &xs)
+		xs.swap(*from);
+	return true;
+}
+
+// the positions of 'keys' in ascending order, for keys that are all numbers
+// or all strings, which are then compared directly
+static bool sort_keys (std::vector<int>& order, const std::vector<value>& keys, state& s)
+{
+	int size = keys.size();
+	order.resize(size);
+	if (size == 0)
+		return true;
+	
+	auto type = keys[0].type;
+	for (int i = 0; i < size; i++)
+		if (keys[i].type != type ||
+				(type != value::type_number && type != value::type_string))
+		{
+			s.error().die()
+				<< "Cannot sort values of type '" << keys[0].type_str()
+				<< "' and '" << keys[i].type_str() << "'";
+			return false;
+		}
+	
+	if (type == value::type_number)
+	{
+		std::vector<std::pair<number, int>> xs(size);
+		for (int i = 0; i < size; i++)
+			xs[i] = std::make_pair(keys[i].num, i);
+		
+		if (!merge_sort(xs, s, [] (bool& lt, const std::pair<number, int>& a,
+				const std::pair<number, int>& b, state&)
+		{
+			lt = a.first < b.first;
+			return true;
+		}))
+			return false;
+		
+		for (int i = 0; i < size; i++)
+			order[i] = xs[i].second;
+	}
+	else
+	{
+		for (int i = 0; i < size; i++)
+			order[i] = i;
+		
+		if (!merge_sort(order, s, [&] (bool& lt, int a, int b, state&)
+		{
+			lt = keys[a].str < keys[b].str;
+			return true;
+		}))
+			return false;
+	}
+	return true;
+}
+
+static value in_order (const std::vector<value>& items, const std::vector<int>& order)
+{
+	std::vector<value> vs;
+	vs.reserve(order.size());
+	for (int i : order)
+		vs.push_back(items[i]);
+	return value::from_list(list::basic(std::move(vs)));
+}
+
 
 #define _args_ \
 	\
@@ -27,7 +242,83 @@ namespace xy {
 #define check_one(name_) \
 	if (!args.check(name_, s, { value::type_any } )) return false
 
-void state::import_native_functions (environment& e)
+
+typedef std::unordered_set<value, value::hasher, value::equal_to> value_set;
+typedef std::unordered_map<value, int, value::hasher, value::equal_to> value_index;
+
+static void fill_set (value_set& set, value it)
+{
+	for (int i = 0, size = it.list_size(); i < size; i++)
+		set.insert(it.list_get(i));
+}
+
+// list of the elements of 'it', keeping those that are (or are not) in 'b'
+static value filter_set (value it, value b, bool keep, state& s)
+{
+	value_set set(b.list_size(), value::hasher(), value::equal_to(s));
+	fill_set(set, b);
+	
+	std::vector<value> vs;
+	for (int i = 0, size = it.list_size(); i < size; i++)
+	{
+		value x(it.list_get(i));
+		if ((set.count(x) > 0) == keep)
+			vs.push_back(x);
+	}
+	return value::from_list(list::basic(vs));
+}
+
+// groups the elements of 'it' by f(x), in order of first appearance; the
+// result is a list of [key, group] pairs, or [key, count] pairs if 'count'
+static bool group (value& out, value it, const std::shared_ptr<function>& func, bool count, state& s)
+{
+	value_index index(it.list_size(), value::hasher(), value::equal_to(s));
+	std::vector<value> keys;
+	std::vector<std::vector<value>> groups;
+	std::vector<int> counts;
+	value k;
+	
+	for (int i = 0, size = it.list_size(); i < size; i++)
+	{
+		value x(it.list_get(i));
+		if (!func->call(k, argument_list { x }, s))
+			return false;
+		
+		int g;
+		auto found = index.find(k);
+		if (found == index.end())
+		{
+			g = keys.size();
+			index.insert(std::make_pair(k, g));
+			keys.push_back(k);
+			groups.push_back(std::vector<value>());
+			counts.push_back(0);
+		}
+		else
+			g = found->second;
+		
+		counts[g]++;
+		if (!count)
+			groups[g].push_back(x);
+	}
+	
+	std::vector<value> vs;
+	for (int g = 0, size = keys.size(); g < size; g++)
+		vs.push_back(value::from_list(list::basic(std::vector<value>
+			{
+				keys[g],
+				count ? value::from_number(counts[g]) :
+				        value::from_list(list::basic(groups[g]))
+			})));
+	
+	out = value::from_list(list::basic(vs));
+	return true;
+}
+
+
+
+
+void program::import_native_functions (environment& e)
 {
 	math_func1("sqrt", sqrt);
 	math_func1("log", log);
@@ -158,6 +449,75 @@ void state::import_native_functions (environment& e)
 		return true;
 	});
 	
+	// 'f' must be associative: the items are folded in chunks, and those
+	// combined in a tree, the same for every list of the same length, on
+	// the worker threads when costly enough; 'z' is combined last, on the
+	// left. sums and products of numbers are also taken in lanes, so 'f'
+	// must commute there, as '(&+)' and '(&*)' do
+	e.add_native("reduce", [] ( _args_ )
+	{
+		if (!args.check("reduce", s, { value::type_function,
+		                               value::type_any,
+		                               value::type_iterable }))
+			return false;
+		
+		auto func(args.get(0).func_obj);
+		value z(args.get(1));
+		value it(args.get(2));
+		int size = it.list_size();
+		if (size == 0)
+		{
+			out = z;
+			return true;
+		}
+		
+		std::vector<value> items(size);
+		for (int i = 0; i < size; i++)
+			items[i] = it.list_get(i);
+		
+		int op = func->is_native() ? 0 :
+			static_cast<soft_function*>(func.get())->section();
+		if ((op == '+' || op == '*') && z.type == value::type_number)
+		{
+			std::vector<number> xs(size);
+			int i = 0;
+			for (; i < size && items[i].type == value::type_number; i++)
+				xs[i] = items[i].num;
+			
+			number r;
+			if (i == size)
+			{
+				if (!reduce_numbers(r, xs, op, s))
+					return false;
+				out = value::from_number(op == '+' ? z.num + r : z.num * r);
+				return true;
+			}
+		}
+		
+		int chunk = reduce_chunk(size);
+		std::vector<value> parts((size + chunk - 1) / chunk);
+		auto apply = [&] (value& r, const value& a, const value& b, state& ws)
+		{
+			return func->call(r, argument_list { a, b }, ws);
+		};
+		
+		if (!worker_pool::each(s, parts.size(), [&] (int c, state& ws)
+		{
+			int start = c * chunk, end = std::min(start + chunk, size);
+			value acc(items[start]);
+			for (int i = start + 1; i < end; i++)
+				if (!apply(acc, acc, items[i], ws))
+					return false;
+			parts[c] = acc;
+			return true;
+		}))
+			return false;
+		
+		if (!combine_tree(parts, s, apply))
+			return false;
+		return apply(out, z, parts[0], s);
+	});
+	
 	
 	e.add_native("filter", [] ( _args_ )
 	{
@@ -207,6 +567,169 @@ void state::import_native_functions (environment& e)
 		return true;
 	});
 	
+	// as above, with the callback run on the worker threads, in no
+	// particular order
+	e.add_native("pfilter", [] ( _args_ )
+	{
+		if (!args.check("pfilter", s, { value::type_function,
+		                                value::type_iterable }))
+			return false;
+		auto func(args.get(0).func_obj);
+		value it(args.get(1));
+		int size = it.list_size();
+		std::vector<value> items(size);
+		std::vector<char> keep(size);
+		for (int i = 0; i < size; i++)
+			items[i] = it.list_get(i);
+		
+		if (!worker_pool::each(s, size, [&] (int i, state& ws)
+		{
+			value b;
+			if (!func->call(b, argument_list { items[i] }, ws))
+				return false;
+			keep[i] = b.condition();
+			return true;
+		}))
+			return false;
+		
+		std::vector<value> vs;
+		for (int i = 0; i < size; i++)
+			if (keep[i])
+				vs.push_back(items[i]);
+		out = value::from_list(list::basic(vs));
+		return true;
+	});
+	
+	e.add_native("pmap", [] ( _args_ )
+	{
+		if (!args.check("pmap", s, { value::type_function,
+		                             value::type_iterable }))
+			return false;
+		auto func(args.get(0).func_obj);
+		value it(args.get(1));
+		int size = it.list_size();
+		std::vector<value> vs(size);
+		for (int i = 0; i < size; i++)
+			vs[i] = it.list_get(i);
+		
+		if (!worker_pool::each(s, size, [&] (int i, state& ws)
+		{
+			return func->call(vs[i], argument_list { vs[i] }, ws);
+		}))
+			return false;
+		
+		out = value::from_list(list::basic(vs));
+		return true;
+	});
+	
+	// like 'pmap', over 'procs' forked processes rather than threads
+	e.add_native("pmap_proc", [] ( _args_ )
+	{
+		if (!args.check("pmap_proc", s, { value::type_function,
+		                                  value::type_iterable,
+		                                  value::type_number }))
+			return false;
+		return process_map::run(out, args.get(0).func_obj, args.get(1),
+			(int)(args.get(2).num), s);
+	});
+	
+	// stable; numbers or strings by their order, or anything by 'cmp',
+	// called as cmp(a, b) to tell whether 'a' goes before 'b'
+	e.add_native("sort", [] ( _args_ )
+	{
+		std::vector<value> items;
+		std::vector<int> order;
+		
+		if (args.check("sort", s, { value::type_iterable }, false))
+		{
+			value it(args.get(0));
+			items.reserve(it.list_size());
+			for (int i = 0, size = it.list_size(); i < size; i++)
+				items.push_back(it.list_get(i));
+			
+			if (!sort_keys(order, items, s))
+				return false;
+		}
+		else
+		{
+			if (!args.check("sort", s, { value::type_function,
+			                             value::type_iterable }))
+				return false;
+			
+			auto func(args.get(0).func_obj);
+			value it(args.get(1));
+			items.reserve(it.list_size());
+			for (int i = 0, size = it.list_size(); i < size; i++)
+			{
+				items.push_back(it.list_get(i));
+				order.push_back(i);
+			}
+			
+			if (!merge_sort(order, s, [&] (bool& lt, int a, int b, state& ws)
+			{
+				value r;
+				if (!func->call(r, argument_list { items[a], items[b] }, ws))
+					return false;
+				if (!r.is_type(value::type_bool))
+				{
+					ws.error().die()
+						<< "Comparison function of 'sort' must return bool, not '"
+						<< r.type_str() << "'";
+					return false;
+				}
+				lt = r.cond;
+				return true;
+			}))
+				return false;
+		}
+		
+		out = in_order(items, order);
+		return true;
+	});
+	
+	// sorts by key(x), called once for every item
+	e.add_native("sort_by", [] ( _args_ )
+	{
+		if (!args.check("sort_by", s, { value::type_function,
+		                                value::type_iterable }))
+			return false;
+		
+		auto func(args.get(0).func_obj);
+		value it(args.get(1));
+		int size = it.list_size();
+		std::vector<value> items(size), keys(size);
+		for (int i = 0; i < size; i++)
+			items[i] = it.list_get(i);
+		
+		if (!worker_pool::each(s, size, [&] (int i, state& ws)
+		{
+			return func->call(keys[i], argument_list { items[i] }, ws);
+		}))
+			return false;
+		
+		std::vector<int> order;
+		if (!sort_keys(order, keys, s))
+			return false;
+		out = in_order(items, order);
+		return true;
+	});
+	
+	// 'f' is called without arguments, maybe by another thread; see
+	// worker_pool::spawn
+	e.add_native("spawn", [] ( _args_ )
+	{
+		if (!args.check("spawn", s, { value::type_function }))
+			return false;
+		return worker_pool::spawn(out, args.get(0).func_obj, s);
+	});
+	
+	e.add_native("await", [] ( _args_ )
+	{
+		if (!args.check("await", s, { value::type_future }))
+			return false;
+		return worker_pool::await(out, args.get(0), s);
+	});
+	
 	e.add_native("fread", [] ( _args_ )
 	{
 		if (!args.check("fread", s, { value::type_string,
@@ -295,6 +818,144 @@ void state::import_native_functions (environment& e)
 	});
 	
 	
+	///-    hashed collections    -///
+	
+	e.add_native("unique", [] ( _args_ )
+	{
+		if (!args.check("unique", s, { value::type_iterable }))
+			return false;
+		
+		value it(args.get(0));
+		value_set seen(it.list_size(), value::hasher(), value::equal_to(s));
+		std::vector<value> vs;
+		for (int i = 0, size = it.list_size(); i < size; i++)
+		{
+			value x(it.list_get(i));
+			if (seen.insert(x).second)
+				vs.push_back(x);
+		}
+		
+		out = value::from_list(list::basic(vs));
+		return true;
+	});
+	
+	e.add_native("contains_all", [] ( _args_ )
+	{
+		if (!args.check("contains_all", s, { value::type_iterable,
+		                                     value::type_iterable }))
+			return false;
+		
+		value it(args.get(0)), search(args.get(1));
+		value_set set(it.list_size(), value::hasher(), value::equal_to(s));
+		fill_set(set, it);
+		
+		for (int i = 0, size = search.list_size(); i < size; i++)
+			if (set.count(search.list_get(i)) == 0)
+			{
+				out = value::from_bool(false);
+				return true;
+			}
+		out = value::from_bool(true);
+		return true;
+	});
+	
+	e.add_native("intersect", [] ( _args_ )
+	{
+		if (!args.check("intersect", s, { value::type_iterable,
+		                                  value::type_iterable }))
+			return false;
+		
+		out = filter_set(args.get(0), args.get(1), true, s);
+		return true;
+	});
+	
+	e.add_native("difference", [] ( _args_ )
+	{
+		if (!args.check("difference", s, { value::type_iterable,
+		                                   value::type_iterable }))
+			return false;
+		
+		out = filter_set(args.get(0), args.get(1), false, s);
+		return true;
+	});
+	
+	e.add_native("group_by", [] ( _args_ )
+	{
+		if (!args.check("group_by", s, { value::type_function,
+		                                 value::type_iterable }))
+			return false;
+		
+		return group(out, args.get(1), args.get(0).func_obj, false, s);
+	});
+	
+	e.add_native("count_by", [] ( _args_ )
+	{
+		if (!args.check("count_by", s, { value::type_function,
+		                                 value::type_iterable }))
+			return false;
+		
+		return group(out, args.get(1), args.get(0).func_obj, true, s);
+	});
+	
+	
+	///-    memoization    -///
+	
+	e.add_native("memoize", [] ( _args_ )
+	{
+		int capacity = XY_DEFAULT_MEMO_CAPACITY;
+		if (args.size == 2)
+		{
+			if (!args.check("memoize", s, { value::type_function, value::type_int }))
+				return false;
+			capacity = (int)(args.get(1).num);
+		}
+		else if (!args.check("memoize", s, { value::type_function }))
+			return false;
+		
+		auto func(args.get(0).func_obj);
+		if (func->is_native())
+		{
+			s.error().die()
+				<< "Cannot memoize native function '" << func->name() << "'";
+			return false;
+		}
+		
+		std::shared_ptr<soft_function> m(
+			new soft_function(*std::static_pointer_cast<soft_function>(func)));
+		m->memoize(capacity);
+		out = value::from_function(m);
+		return true;
+	});
+	
+	e.add_native("memo_stats", [] ( _args_ )
+	{
+		if (!args.check("memo_stats", s, { value::type_function }))
+			return false;
+		
+		auto func(args.get(0).func_obj);
+		std::shared_ptr<memo_table> memo(nullptr);
+		if (!func->is_native())
+			memo = std::static_pointer_cast<soft_function>(func)->memo();
+		
+		if (memo == nullptr)
+		{
+			out = value();
+			return true;
+		}
+		
+		out = value::from_map(map::create(
+			{
+				map::get_hash("hits"), map::get_hash("misses"),
+				map::get_hash("size"), map::get_hash("capacity")
+			},
+			{
+				value::from_number(memo->hits()), value::from_number(memo->misses()),
+				value::from_number(memo->size()), value::from_number(memo->capacity())
+			}));
+		return true;
+	});
+	
+	
 	///-    data types    -///
 	
 	e.add_native("int", [] ( _args_ )
@@ -366,9 +1027,46 @@ void state::import_native_functions (environment& e)
 	type_check_func("number?", type_number);
 	type_check_func("function?", type_function);
 	type_check_func("map?", type_map);
+	type_check_func("future?", type_future);
 	type_check_func("int?", type_int);
 	type_check_func("iterable?", type_iterable);
 	type_check_func("orderable?", type_orderable);
+	
+	
+	for (auto name : { "sqrt", "log", "sin", "cos", "tan", "length", "indexof",
+	                   "unique", "contains_all", "intersect", "difference",
+	                   "int", "string", "number", "list", "bool", "void",
+	                   "void?", "list?", "string?", "number?", "function?",
+	                   "map?", "future?", "int?", "iterable?", "orderable?", "await" })
+		e.find_function(name)->set_purity(function::purity_pure);
+	
+	for (auto name : { "sqrt", "log", "sin", "cos", "tan", "length", "indexof",
+	                   "int", "number" })
+		e.find_function(name)->set_result_type(value::type_number);
+	for (auto name : { "bool", "contains_all", "void?", "list?", "string?",
+	                   "number?", "function?", "map?", "future?", "int?",
+	                   "iterable?", "orderable?" })
+		e.find_function(name)->set_result_type(value::type_bool);
+	e.find_function("string")->set_result_type(value::type_string);
+	e.find_function("list")->set_result_type(value::type_list);
+	e.find_function("pmap_proc")->set_result_type(value::type_list);
+	e.find_function("sort")->set_result_type(value::type_list);
+	e.find_function("sort_by")->set_result_type(value::type_list);
+	e.find_function("void")->set_result_type(value::type_void);
+	e.find_function("spawn")->set_result_type(value::type_future);
+	
+	for (auto name : { "distribute", "first", "foldl", "foldr", "reduce", "filter",
+	                   "map", "pfilter", "pmap", "pmap_proc", "spawn", "sort", "sort_by",
+	                   "group_by", "count_by", "try" })
+		e.find_function(name)->set_purity(function::purity_higher_order);
+	// the handler as well as the body
+	e.find_function("try")->set_called_arguments(3);
+	
+	// newer natives, whose names programs may already use for their own
+	for (auto name : { "await", "contains_all", "count_by", "difference", "group_by",
+	                   "intersect", "memo_stats", "memoize", "pfilter", "pmap",
+	                   "pmap_proc", "reduce", "sort", "sort_by", "spawn", "unique" })
+		e.find_function(name)->set_redefinable(true);
 }
 
 
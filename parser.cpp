@@ -6,6 +6,7 @@
 #include "list.h"
 #include "syntax.h"
 #include "expression.h"
+#include "memo.h"
 
 namespace xy {
 
@@ -59,6 +60,65 @@ struct function_generator
 		}
 		return true;
 	}
+	
+	// every guard and body expression, for optimization passes
+	void all_expressions (child_list& out)
+	{
+		for (auto body : all_bodies)
+		{
+			for (int i = 0; i < body->params.size(); i++)
+				if (body->params.condition(i) != nullptr)
+					out.push_back(&body->params.condition(i));
+			out.push_back(&body->body);
+		}
+	}
+	
+	void optimize (state& s)
+	{
+		child_list exps;
+		all_expressions(exps);
+		
+		for (auto e : exps)
+			expression::fold_constants(*e, s);
+		
+		// inlined arguments may be constant, so fold again
+		for (auto body : all_bodies)
+			expression::inline_calls(*body);
+		
+		exps.clear();
+		all_expressions(exps);
+		for (auto e : exps)
+			expression::fold_constants(*e, s);
+		
+		purity_analysis pure;
+		for (auto body : all_bodies)
+		{
+			expression::eliminate_common(*body, pure);
+			expression::check_tail_concats(*body, pure);
+		}
+		
+		// operators on proven numbers skip their tag checks
+		type_analysis types;
+		types.run(s.global());
+		s.set_type_stats(types.nodes, types.proven);
+		
+		exps.clear();
+		all_expressions(exps);
+		for (auto e : exps)
+			expression::specialize_types(*e);
+		
+		// last, as the passes above do not look into hoisted invariants
+		std::set<func_body*> own;
+		for (auto body : all_bodies)
+			own.insert(body.get());
+		for (auto& f : s.global().functions())
+			if (!f->is_native())
+			{
+				auto soft = static_cast<soft_function*>(f.get());
+				if (soft->bodies().size() > 0 && own.count(soft->bodies()[0].get()))
+					soft->hoist_invariants(pure);
+			}
+	}
 };
 
 class lambda_expression
@@ -79,6 +139,24 @@ public:
 		return g.locate_symbols(locator);
 	}
 	
+	virtual void children (child_list& same, child_list& inner)
+	{
+		g.all_expressions(inner);
+	}
+	
+	virtual void function_bodies (std::vector<std::shared_ptr<func_body>>& out)
+	{
+		for (auto body : g.all_bodies)
+			out.push_back(body);
+	}
+	
+	virtual int infer (type_analysis& types, type_facts& facts)
+	{
+		for (auto body : g.all_bodies)
+			types.body(*body);
+		return value::type_function;
+	}
+	
 	void add (const std::shared_ptr<func_body>& body)
 	{
 		g.all_bodies.push_back(body);
@@ -129,6 +207,9 @@ bool parser::parse_env (environment& env)
 	
 	bool r = g.locate_symbols(locator);
 	locator = old_loc;
+	
+	if (r)
+		g.optimize(parent);
 	return r;
 }
 
@@ -138,8 +219,25 @@ bool parser::parse_declare (environment& env, function_generator& g)
 		return false;
 	
 	std::string func_name;
+	bool memoize = false;
+	
+	// let memo fib (n) = ...
+	if (lex.current().tok == lexer::token::symbol_token &&
+			lex.current().str == "memo")
+	{
+		if (!lex.advance())
+			return false;
+		
+		memoize = lex.current().tok == lexer::token::symbol_token ||
+		          lex.current().tok == lexer::token::seq_token;
+		
+		if (!memoize) // just a function called 'memo'
+			g.last_function = func_name = "memo";
+	}
 	
-	if (lex.current().tok == lexer::token::seq_token)
+	if (func_name.size() > 0)
+		;
+	else if (lex.current().tok == lexer::token::seq_token)
 	{
 		if (g.last_function == "")
 		{
@@ -148,6 +246,9 @@ bool parser::parse_declare (environment& env, function_generator& g)
 			return false;
 		}
 		func_name = g.last_function;
+		
+		if (!lex.advance())
+			return false;
 	}
 	else
 	{
@@ -156,11 +257,11 @@ bool parser::parse_declare (environment& env, function_generator& g)
 		func_name = lex.current().str;
 		
 		g.last_function = func_name;
+		
+		if (!lex.advance())
+			return false;
 	}
 	
-	if (!lex.advance())
-		return false;
-	
 	std::shared_ptr<soft_function> soft_func =
 		env.find_or_add(func_name);
 	
@@ -179,6 +280,9 @@ bool parser::parse_declare (environment& env, function_generator& g)
 	soft_func->add_overload(body);
 	g.all_bodies.push_back(body);
 	
+	if (memoize)
+		soft_func->memoize(XY_DEFAULT_MEMO_CAPACITY);
+	
 	return true;
 }
 
@@ -527,7 +631,8 @@ bool parser::parse_exp (std::shared_ptr<expression>& out)
 	}
 	out = builder.finish();
 	
-	if (lex.current().tok == SYNTAX_LCOMP_SEP)
+	if (lex.current().tok == SYNTAX_LCOMP_SEP ||
+			lex.current().tok == lexer::token::plcomp_token)
 		if (!parse_list_comp(out, out))
 			return false;
 	
@@ -693,13 +798,15 @@ bool parser::parse_lambda (std::shared_ptr<expression>& out)
 
 bool parser::parse_list_comp (std::shared_ptr<expression>& out, const std::shared_ptr<expression>& list_exp)
 {
-	if (!lex.expect(SYNTAX_LCOMP_SEP, true))
+	bool parallel = lex.current().tok == lexer::token::plcomp_token;
+	if (!lex.expect(parallel ? (int)(lexer::token::plcomp_token) : SYNTAX_LCOMP_SEP, true))
 		return false;
 	if (!lex.expect(lexer::token::symbol_token))
 		return false;
 	
 	std::shared_ptr<expression> e;
 	std::shared_ptr<list_comp_expression> comp(new list_comp_expression(list_exp, lex.current().str));
+	comp->set_parallel(parallel);
 	if (!lex.advance())
 		return false;
 	
@@ -0,0 +1,432 @@
+#include "include.h"
+#include "processes.h"
+#include "function.h"
+#include "list.h"
+#include "map.h"
+#include "workers.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace xy {
+
+
+// every process gets about this many chunks of the list to do
+#define XY_PROC_CHUNKS 8
+
+
+
+
+static bool write_all (int fd, const char* data, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t n = write(fd, data, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+static bool read_all (int fd, char* data, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t n = read(fd, data, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+template <typename T>
+static void put (std::string& out, T x)
+{
+	out.append(reinterpret_cast<const char*>(&x), sizeof(x));
+}
+
+template <typename T>
+static bool take (T& x, const char*& p, const char* end)
+{
+	if (end - p < (ptrdiff_t)(sizeof(x)))
+		return false;
+	std::memcpy(&x, p, sizeof(x));
+	p += sizeof(x);
+	return true;
+}
+
+
+bool process_map::encode (std::string& out, const value& v, state& s)
+{
+	out.push_back((char)(v.type));
+
+	switch (v.type)
+	{
+	case value::type_void:
+		return true;
+
+	case value::type_number:
+		put(out, v.num);
+		return true;
+
+	case value::type_bool:
+		out.push_back(v.cond ? 1 : 0);
+		return true;
+
+	case value::type_string:
+		put(out, (uint32_t)(v.str.size()));
+		out.append(v.str);
+		return true;
+
+	case value::type_list:
+		{
+			int size = v.list_obj->size();
+			put(out, (uint32_t)(size));
+			for (int i = 0; i < size; i++)
+				if (!encode(out, v.list_obj->get(i), s))
+					return false;
+			return true;
+		}
+
+	case value::type_map:
+		{
+			std::vector<map::hash> keys;
+			std::vector<value> vals;
+			v.map_obj->entries(keys, vals);
+			put(out, (uint32_t)(keys.size()));
+			for (int i = 0, size = keys.size(); i < size; i++)
+			{
+				put(out, keys[i]);
+				if (!encode(out, vals[i], s))
+					return false;
+			}
+			return true;
+		}
+
+	default:
+		s.error().die()
+			<< "Cannot send value of type '" << v.type_str() << "' between processes";
+		return false;
+	}
+}
+
+bool process_map::decode (value& out, const char*& p, const char* end)
+{
+	char type;
+	uint32_t size;
+	if (!take(type, p, end))
+		return false;
+
+	switch (type)
+	{
+	case value::type_void:
+		out = value();
+		return true;
+
+	case value::type_number:
+		out = value(value::type_number);
+		return take(out.num, p, end);
+
+	case value::type_bool:
+		{
+			char c;
+			if (!take(c, p, end))
+				return false;
+			out = value::from_bool(c != 0);
+			return true;
+		}
+
+	case value::type_string:
+		if (!take(size, p, end) || end - p < (ptrdiff_t)(size))
+			return false;
+		out = value::from_string(std::string(p, size));
+		p += size;
+		return true;
+
+	case value::type_list:
+		{
+			if (!take(size, p, end))
+				return false;
+			std::vector<value> vs(size);
+			for (auto& x : vs)
+				if (!decode(x, p, end))
+					return false;
+			out = value::from_list(list::basic(std::move(vs)));
+			return true;
+		}
+
+	case value::type_map:
+		{
+			if (!take(size, p, end))
+				return false;
+			std::vector<map::hash> keys(size);
+			std::vector<value> vals(size);
+			for (uint32_t i = 0; i < size; i++)
+				if (!take(keys[i], p, end) || !decode(vals[i], p, end))
+					return false;
+			out = value::from_map(map::create(keys, vals));
+			return true;
+		}
+
+	default:
+		return false;
+	}
+}
+
+
+
+
+// a reply: the chunk, whether it succeeded, and the size of the encoded
+// results or error message that follow
+struct reply
+{
+	int32_t chunk, ok;
+	uint32_t size;
+};
+
+void process_map::serve (int requests, int results, const std::shared_ptr<function>& f,
+		value it, int chunk, state& s)
+{
+	// the worker threads of 's' are not in this process
+	state local(s.loaded());
+	local.set_threads(1);
+	local.guard_stack();
+
+	int size = it.list_size();
+	int32_t c;
+	while (read_all(requests, reinterpret_cast<char*>(&c), sizeof(c)))
+	{
+		int start = c * chunk, end = std::min(start + chunk, size);
+		std::vector<value> vs;
+		bool ok = true;
+		for (int i = start; ok && i < end; i++)
+		{
+			value x;
+			ok = f->call(x, argument_list { it.list_get(i) }, local);
+			vs.push_back(x);
+		}
+
+		std::string data;
+		if (ok)
+			ok = encode(data, value::from_list(list::basic(std::move(vs))), local);
+		if (!ok)
+			data = local.error().flush();
+
+		reply r { c, ok, (uint32_t)(data.size()) };
+		if (!write_all(results, reinterpret_cast<const char*>(&r), sizeof(r)) ||
+				!write_all(results, data.data(), data.size()))
+			break;
+	}
+
+	std::cout.flush();
+	_exit(0);
+}
+
+
+bool process_map::run (value& out, const std::shared_ptr<function>& f,
+		value it, int procs, state& s)
+{
+	int size = it.list_size();
+	if (procs < 1)
+	{
+		s.error().die() << "Cannot map over " << procs << " processes";
+		return false;
+	}
+	if (size == 0)
+	{
+		out = value::from_list(list::empty());
+		return true;
+	}
+
+	// see process_map; the items are then mapped here instead
+	if (!worker_pool::idle(s) || s.program_states() > 1)
+	{
+		std::vector<value> vs(size);
+		for (int i = 0; i < size; i++)
+			if (!f->call(vs[i], argument_list { it.list_get(i) }, s))
+				return false;
+		out = value::from_list(list::basic(std::move(vs)));
+		return true;
+	}
+
+	int chunk = std::max(1, size / (procs * XY_PROC_CHUNKS));
+	int chunks = (size + chunk - 1) / chunk;
+	procs = std::min(procs, chunks);
+
+	// a process that has died is found by its pipe, not by a signal
+	struct sigaction ignore, old;
+	std::memset(&ignore, 0, sizeof(ignore));
+	ignore.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &ignore, &old);
+
+	// or the children would write what is buffered again
+	std::cout.flush();
+
+	std::vector<child> children;
+	std::string failure;
+	for (int i = 0; i < procs; i++)
+	{
+		int req[2], res[2];
+		if (pipe(req) != 0)
+		{
+			failure = "Cannot create pipe";
+			break;
+		}
+		if (pipe(res) != 0)
+		{
+			close(req[0]);
+			close(req[1]);
+			failure = "Cannot create pipe";
+			break;
+		}
+
+		int pid = fork();
+		if (pid == 0)
+		{
+			close(req[1]);
+			close(res[0]);
+			for (auto& c : children)
+			{
+				close(c.requests);
+				close(c.results);
+			}
+			serve(req[0], res[1], f, it, chunk, s);
+		}
+
+		close(req[0]);
+		close(res[1]);
+		if (pid < 0)
+		{
+			close(req[1]);
+			close(res[0]);
+			failure = "Cannot fork process";
+			break;
+		}
+		children.push_back(child { pid, req[1], res[0], -1 });
+	}
+
+	std::vector<value> parts(chunks);
+	int next = 0, failed = chunks;
+	std::string error;
+	const char* died = "Process evaluating 'pmap_proc' exited unexpectedly";
+
+	auto fail = [&] (int k, const std::string& message)
+	{
+		if (k < failed)
+		{
+			failed = k;
+			error = message;
+		}
+	};
+	// chunks past a failed one would not have been reached. a child that
+	// cannot be written to has died, and the chunk would be left undone
+	auto hand_out = [&] (child& c)
+	{
+		c.chunk = -1;
+		if (next >= std::min(failed, chunks))
+			return;
+
+		int32_t k = next;
+		if (write_all(c.requests, reinterpret_cast<const char*>(&k), sizeof(k)))
+			c.chunk = next++;
+		else
+			fail(next, died);
+	};
+
+	if (failure.size() == 0)
+		for (auto& c : children)
+			hand_out(c);
+
+	for (;;)
+	{
+		std::vector<pollfd> fds;
+		std::vector<child*> busy;
+		for (auto& c : children)
+			if (c.chunk >= 0)
+			{
+				fds.push_back(pollfd { c.results, POLLIN, 0 });
+				busy.push_back(&c);
+			}
+		if (busy.size() == 0)
+			break;
+
+		if (poll(fds.data(), fds.size(), -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			failure = "Cannot wait for processes";
+			break;
+		}
+
+		for (int i = 0, n = busy.size(); i < n; i++)
+		{
+			if (fds[i].revents == 0)
+				continue;
+
+			child& c = *busy[i];
+			reply r;
+			std::string data;
+			if (!read_all(c.results, reinterpret_cast<char*>(&r), sizeof(r)) ||
+					(data.resize(r.size), !read_all(c.results, &data[0], r.size)))
+			{
+				fail(c.chunk, died);
+				c.chunk = -1;
+				continue;
+			}
+
+			const char* p = data.data();
+			if (!r.ok)
+				fail(r.chunk, data);
+			else if (!decode(parts[r.chunk], p, p + data.size()))
+				fail(r.chunk, "Malformed results from process evaluating 'pmap_proc'");
+			hand_out(c);
+		}
+	}
+
+	// children exit with 0 once their requests are closed, even after
+	// failing to write; anything else is reported after the errors of
+	// the items
+	for (auto& c : children)
+	{
+		close(c.requests);
+		close(c.results);
+		int status;
+		if (waitpid(c.pid, &status, 0) != c.pid ||
+				!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			fail(chunks - 1, died);
+	}
+	sigaction(SIGPIPE, &old, nullptr);
+
+	if (failure.size() > 0)
+		fail(-1, failure);
+	else if (next < failed)
+		fail(next, died);
+	if (failed < chunks)
+	{
+		s.error().die() << error;
+		return false;
+	}
+
+	std::vector<value> vs;
+	vs.reserve(size);
+	for (auto& part : parts)
+		for (int i = 0, n = part.list_size(); i < n; i++)
+			vs.push_back(part.list_get(i));
+	out = value::from_list(list::basic(std::move(vs)));
+	return true;
+}
+
+
+};
@@ -0,0 +1,45 @@
+#pragma once
+#include "state.h"
+#include "value.h"
+
+namespace xy {
+
+class function;
+
+
+// maps a function over a list in forked copies of this process, which
+// inherit the loaded program and the list, and are handed chunks of it by
+// index; their results come back through pipes in a binary encoding.
+// a forked process has only the thread that forked it, so any lock another
+// thread holds, such as that of a memo table, would never be released in
+// it: only a state that is not a worker forks, while its worker pool is
+// idle and no other state evaluates the program; otherwise the items are
+// mapped serially
+class process_map
+{
+public:
+	// out = [f(x) for x in it], in order, over 'procs' processes. stops at
+	// an error, reporting that of the lowest failing item
+	static bool run (value& out, const std::shared_ptr<function>& f,
+			value it, int procs, state& s);
+
+	// the encoding: a type byte, then the number, the flag, or the length
+	// and contents of strings, lists and maps. functions and futures have
+	// none, and fail
+	static bool encode (std::string& out, const value& v, state& s);
+	static bool decode (value& out, const char*& p, const char* end);
+
+private:
+	struct child
+	{
+		int pid;
+		int requests, results; // pipe ends
+		int chunk;             // handed to it, else -1
+	};
+
+	static void serve (int requests, int results, const std::shared_ptr<function>& f,
+			value it, int chunk, state& s);
+};
+
+
+};
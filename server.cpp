@@ -0,0 +1,377 @@
+#include "include.h"
+#include "server.h"
+#include "function.h"
+#include "value.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace xy {
+
+
+// requests waiting for a thread; the connections past these are not read
+// from until there is room
+#define XY_SERVE_QUEUE        256
+// longest request, in bytes, and how long in seconds a client may take to
+// send the rest of one, or to read its reply, before it is dropped
+#define XY_SERVE_MAX_REQUEST  (64 << 20)
+#define XY_SERVE_TIMEOUT      10
+
+
+
+
+static bool send_all (int fd, const char* data, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+static bool recv_all (int fd, char* data, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t n = recv(fd, data, size, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+static bool send_frame (int fd, const std::string& text)
+{
+	uint32_t size = text.size();
+	unsigned char length[4] = {
+		(unsigned char)(size >> 24), (unsigned char)(size >> 16),
+		(unsigned char)(size >> 8), (unsigned char)(size) };
+	return send_all(fd, reinterpret_cast<const char*>(length), 4) &&
+		send_all(fd, text.data(), text.size());
+}
+
+static bool recv_frame (int fd, std::string& text)
+{
+	unsigned char length[4];
+	if (!recv_all(fd, reinterpret_cast<char*>(length), 4))
+		return false;
+	uint32_t size = (uint32_t)(length[0]) << 24 | (uint32_t)(length[1]) << 16 |
+		(uint32_t)(length[2]) << 8 | (uint32_t)(length[3]);
+	if (size > XY_SERVE_MAX_REQUEST)
+		return false;
+
+	text.resize(size);
+	return size == 0 || recv_all(fd, &text[0], size);
+}
+
+
+static int stop_fd = -1;
+
+static void stop_signal (int)
+{
+	char c = 's';
+	if (write(stop_fd, &c, 1) < 0)
+		return;
+}
+
+
+
+
+server::server (state& s, const std::string& p)
+	: owner(s), path(p), listener(-1), stopping(false)
+{
+	wake[0] = wake[1] = -1;
+}
+
+server::~server ()
+{
+	for (int fd : { listener, wake[0], wake[1] })
+		if (fd >= 0)
+			close(fd);
+}
+
+
+bool server::run ()
+{
+	handle = owner.global().find_function("handle");
+	if (handle == nullptr)
+	{
+		owner.error().die() << "no handle function found";
+		return false;
+	}
+
+	sockaddr_un addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+	{
+		owner.error().die() << "Socket path '" << path << "' is too long";
+		return false;
+	}
+	std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+	// left by a server before
+	struct stat info;
+	if (stat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+		unlink(path.c_str());
+
+	listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listener < 0 ||
+			bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+			listen(listener, SOMAXCONN) != 0 ||
+			pipe(wake) != 0)
+	{
+		owner.error().die() << "Cannot listen on '" << path << "': " << std::strerror(errno);
+		return false;
+	}
+
+	// the threads are kept busy by requests already, so those of parallel
+	// natives would only compete with them
+	int threads = std::max(1, owner.get_threads());
+	owner.set_threads(1);
+
+	stop_fd = wake[1];
+	struct sigaction stop, old_int, old_term;
+	std::memset(&stop, 0, sizeof(stop));
+	stop.sa_handler = stop_signal;
+	sigaction(SIGINT, &stop, &old_int);
+	sigaction(SIGTERM, &stop, &old_term);
+
+	pthread_t poller;
+	bool polling = pthread_create(&poller, nullptr, poller_main, this) == 0;
+
+	std::vector<pthread_t> others;
+	for (int i = 1; polling && i < threads; i++)
+	{
+		pthread_attr_t attr;
+		pthread_t thread;
+		pthread_attr_init(&attr);
+		bool started =
+			pthread_attr_setstacksize(&attr, owner.get_stack_size()) == 0 &&
+			pthread_create(&thread, &attr, thread_main, this) == 0;
+		pthread_attr_destroy(&attr);
+
+		if (!started)
+			break;
+		others.push_back(thread);
+	}
+
+	if (polling)
+	{
+		answer(owner);
+		pthread_join(poller, nullptr);
+	}
+	for (auto thread : others)
+		pthread_join(thread, nullptr);
+
+	sigaction(SIGINT, &old_int, nullptr);
+	sigaction(SIGTERM, &old_term, nullptr);
+	stop_fd = -1;
+
+	for (int fd : idle)
+		close(fd);
+	idle.clear();
+	unlink(path.c_str());
+
+	if (!polling)
+	{
+		owner.error().die() << "Cannot start serving on '" << path << "'";
+		return false;
+	}
+	return true;
+}
+
+
+void* server::poller_main (void* p)
+{
+	static_cast<server*>(p)->poll_connections();
+	return nullptr;
+}
+
+void* server::thread_main (void* p)
+{
+	auto serv = static_cast<server*>(p);
+	state local(serv->owner.loaded());
+	local.guard_stack();
+	serv->answer(local);
+	return nullptr;
+}
+
+
+// waits for requests on the open connections, and queues them for the
+// threads; a connection leaves the poll until its request is answered
+void server::poll_connections ()
+{
+	std::vector<int> open;
+
+	for (;;)
+	{
+		{
+			std::lock_guard<std::mutex> l(lock);
+			open.insert(open.end(), idle.begin(), idle.end());
+			idle.clear();
+		}
+
+		std::vector<pollfd> fds { pollfd { wake[0], POLLIN, 0 },
+		                          pollfd { listener, POLLIN, 0 } };
+		for (int fd : open)
+			fds.push_back(pollfd { fd, POLLIN, 0 });
+
+		if (poll(fds.data(), fds.size(), -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[0].revents != 0)
+		{
+			char signals[64];
+			ssize_t n = read(wake[0], signals, sizeof(signals));
+			if (std::memchr(signals, 's', std::max(n, (ssize_t)(0))) != nullptr)
+				break;
+		}
+
+		std::vector<int> ready;
+		for (int i = 0, size = open.size(); i < size; i++)
+			if (fds[i + 2].revents != 0)
+				ready.push_back(open[i]);
+			else
+				ready.push_back(-1);
+
+		for (int i = open.size() - 1; i >= 0; i--)
+		{
+			if (ready[i] < 0)
+				continue;
+			open.erase(open.begin() + i);
+
+			std::unique_lock<std::mutex> l(lock);
+			room.wait(l, [&] { return queue.size() < XY_SERVE_QUEUE; });
+			queue.push_back(ready[i]);
+			work.notify_one();
+		}
+
+		if (fds[1].revents != 0)
+		{
+			int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+			if (fd >= 0)
+			{
+				timeval timeout { XY_SERVE_TIMEOUT, 0 };
+				setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+				setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+				open.push_back(fd);
+			}
+		}
+	}
+
+	for (int fd : open)
+		close(fd);
+
+	std::lock_guard<std::mutex> l(lock);
+	stopping = true;
+	work.notify_all();
+}
+
+// answers queued requests, each failing on its own
+void server::answer (state& s)
+{
+	for (;;)
+	{
+		int fd;
+		{
+			std::unique_lock<std::mutex> l(lock);
+			work.wait(l, [&] { return stopping || !queue.empty(); });
+			if (queue.empty())
+				return;
+			fd = queue.front();
+			queue.pop_front();
+			room.notify_one();
+		}
+
+		std::string text;
+		if (!recv_frame(fd, text))
+		{
+			close(fd);
+			continue;
+		}
+
+		value out;
+		bool ok;
+		{
+			state::scope scope(s);
+			ok = handle->call(out, argument_list { value::from_string(text) }, scope);
+		}
+		text = ok ? out.to_str() : s.error().flush();
+
+		char status = ok ? 0 : 1;
+		if (!send_all(fd, &status, 1) || !send_frame(fd, text))
+		{
+			close(fd);
+			continue;
+		}
+
+		{
+			std::lock_guard<std::mutex> l(lock);
+			idle.push_back(fd);
+		}
+		char c = 'r';
+		if (write(wake[1], &c, 1) < 0)
+			continue;
+	}
+}
+
+
+bool server::request (std::string& reply, bool& ok, const std::string& path,
+		const std::string& text, state& s)
+{
+	sockaddr_un addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+	{
+		s.error().die() << "Socket path '" << path << "' is too long";
+		return false;
+	}
+	std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+	{
+		s.error().die() << "Cannot connect to '" << path << "': " << std::strerror(errno);
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	char status;
+	bool good = send_frame(fd, text) &&
+		recv_all(fd, &status, 1) && recv_frame(fd, reply);
+	close(fd);
+
+	if (!good)
+	{
+		s.error().die() << "No reply from '" << path << "'";
+		return false;
+	}
+	ok = status == 0;
+	return true;
+}
+
+
+};
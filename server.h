@@ -0,0 +1,54 @@
+#pragma once
+#include "state.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <pthread.h>
+
+namespace xy {
+
+class function;
+
+
+// answers requests from clients of a unix domain socket, each a string
+// passed to the function 'handle' of the loaded program, with the text of
+// its result. requests are framed by a 4-byte big-endian length, and
+// replies by a status byte, 0 if the call succeeded, else 1 with the error
+// as text, then the length. connections stay open for further requests
+class server
+{
+public:
+	// 's' must have loaded the program; it serves requests as well, along
+	// with get_threads() - 1 states of its own threads
+	server (state& s, const std::string& path);
+	~server ();
+
+	// until SIGINT or SIGTERM, after which queued requests are answered
+	bool run ();
+
+	// a client: sends 'text' to the server at 'path', and reads the reply
+	static bool request (std::string& reply, bool& ok, const std::string& path,
+			const std::string& text, state& s);
+
+private:
+	state& owner;
+	std::string path;
+	std::shared_ptr<function> handle;
+	int listener;
+	int wake[2]; // written when connections are handed back, or to stop
+
+	std::mutex lock;
+	std::condition_variable work, room;
+	std::deque<int> queue;   // connections with a request to read
+	std::vector<int> idle;   // handed back by the threads
+	bool stopping;
+
+	void poll_connections ();
+	void answer (state& s);
+	static void* poller_main (void* p);
+	static void* thread_main (void* p);
+};
+
+
+};
@@ -5,23 +5,64 @@
 #include "value.h"
 #include "parser.h"
 #include "function.h"
+#include "vm.h"
+#include "expression.h"
+#include "workers.h"
+
+#include <pthread.h>
+#include <thread>
 
 namespace xy {
 
 
+#define XY_DEFAULT_MAX_DEPTH  10000000
+#define XY_DEFAULT_STACK_SIZE ((size_t)(1) << 30)
 
+// native stack kept free below the deepest XY call, for natives and
+// expression nesting within a single function body
+#define XY_STACK_RESERVE      (256 * 1024)
 
 
 
-state::state ()
-	: global_env(*this)
+
+
+program::program ()
+	: claimed(false), states(0), sealed(false),
+	  max_depth(XY_DEFAULT_MAX_DEPTH), stack_size(XY_DEFAULT_STACK_SIZE),
+	  engine(state::engine_tree), jit(false),
+	  threads(std::thread::hardware_concurrency()),
+	  type_nodes(0), type_proven(0)
 {
 	import_native_functions(global_env);
 }
 
 
+
+state::state ()
+	: own(new program()), prog(*own), owner(nullptr), primary(true),
+	  depth(0), stack_limit(nullptr)
+{
+	prog.claimed = true;
+	prog.states++;
+}
+
+state::state (program& p)
+	: prog(p), owner(nullptr), primary(!p.claimed.exchange(true)),
+	  depth(0), stack_limit(nullptr)
+{
+	prog.states++;
+}
+
+state::state (state& o)
+	: prog(o.prog), owner(&o), primary(false),
+	  depth(0), stack_limit(nullptr)
+{ }
+
+
 state::~state ()
 {
+	if (owner == nullptr)
+		prog.states--;
 }
 
 
@@ -31,10 +72,29 @@ bool state::load (const std::string& filename)
 	
 	if (!lex.open(filename))
 		return false;
+	return load_from(lex);
+}
+
+bool state::load_string (const std::string& source)
+{
+	lexer lex(*this);
+	
+	if (!lex.open_string(source))
+		return false;
+	return load_from(lex);
+}
+
+bool state::load_from (lexer& lex)
+{
+	if (prog.sealed)
+	{
+		err_handler.die() << "Cannot load into a sealed program";
+		return false;
+	}
 	
 	parser parse(parser(*this, lex));
 	
-	if (!parse.parse_env(global_env))
+	if (!parse.parse_env(prog.global_env))
 		return false;
 	
 	if (!lex.current().eof())
@@ -47,13 +107,131 @@ bool state::load (const std::string& filename)
 
 
 
+void state::seal ()
+{
+	prog.sealed = true;
+	
+	type_analysis types;
+	types.closed = true;
+	types.run(prog.global_env);
+	set_type_stats(types.nodes, types.proven);
+	
+	for (auto& f : prog.global_env.functions())
+		if (!f->is_native())
+			for (auto& b : static_cast<soft_function*>(f.get())->bodies())
+			{
+				for (int i = 0; i < b->params.size(); i++)
+					if (b->params.condition(i) != nullptr)
+						expression::specialize_types(b->params.condition(i));
+				expression::specialize_types(b->body);
+			}
+}
+
+
+worker_pool* state::workers ()
+{
+	if (owner != nullptr || prog.threads <= 1)
+		return nullptr;
+	
+	if (pool == nullptr)
+		pool = std::shared_ptr<worker_pool>(new worker_pool(*this, prog.threads - 1));
+	return pool.get();
+}
+
+vm& state::machine ()
+{
+	if (vm_engine == nullptr)
+		vm_engine = std::shared_ptr<vm>(new vm(*this));
+	return *vm_engine;
+}
+
+
+bool state::depth_guard::check ()
+{
+	if (good)
+		return true;
+	
+	if (parent.depth > parent.prog.max_depth)
+		parent.error().die()
+			<< "Maximum recursion depth exceeded (" << parent.prog.max_depth << ")";
+	else
+		parent.error().die()
+			<< "Stack space exhausted at recursion depth " << parent.depth;
+	return false;
+}
+
+
+struct run_info
+{
+	const std::function<bool()>* fn;
+	state* parent;
+	const char** stack_limit;
+	bool result;
+};
+
+void state::guard_stack ()
+{
+	pthread_attr_t attr;
+	void* low;
+	size_t size;
+	if (pthread_getattr_np(pthread_self(), &attr) == 0)
+	{
+		if (pthread_attr_getstack(&attr, &low, &size) == 0 &&
+				size > 2 * XY_STACK_RESERVE)
+			stack_limit = static_cast<const char*>(low) + XY_STACK_RESERVE;
+		pthread_attr_destroy(&attr);
+	}
+}
+
+static void* run_thread (void* p)
+{
+	auto info = static_cast<run_info*>(p);
+	
+	info->parent->guard_stack();
+	info->result = (*info->fn)();
+	*info->stack_limit = nullptr;
+	return nullptr;
+}
+
+bool state::run (const std::function<bool()>& fn)
+{
+	run_info info { &fn, this, &stack_limit, false };
+	
+	pthread_attr_t attr;
+	pthread_t thread;
+	
+	pthread_attr_init(&attr);
+	bool started =
+		pthread_attr_setstacksize(&attr, prog.stack_size) == 0 &&
+		pthread_create(&thread, &attr, run_thread, &info) == 0;
+	pthread_attr_destroy(&attr);
+	
+	// could not allocate the stack: evaluate on this one, guarding its
+	// end instead
+	if (!started)
+	{
+		const char* outer = stack_limit;
+		guard_stack();
+		bool result = fn();
+		stack_limit = outer;
+		return result;
+	}
+	
+	pthread_join(thread, nullptr);
+	return info.result;
+}
+
+
+
 
-closure::closure (int s, const std::shared_ptr<closure>& p)
-	: parent(p), closure_size(s), values(new value[closure_size])
+closure::closure (int s, const std::shared_ptr<closure>& p, int c, int l)
+	: parent(p), closure_size(s), cache_size(c),
+	  values(new value[closure_size + c + l]), filled(c + l, false)
 { }
 
-closure::closure (const argument_list& args, const std::shared_ptr<closure>& p)
-	: parent(p), closure_size(args.size), values(new value[closure_size])
+closure::closure (const argument_list& args, const std::shared_ptr<closure>& p, int c, int l)
+	: parent(p), closure_size(args.size), cache_size(c),
+	  values(new value[closure_size + c + l]), filled(c + l, false)
 {
 	for (int i = 0; i < args.size; i++)
 		values[i] = args.values[i];
@@ -84,6 +262,64 @@ bool closure::set (int index, const value& val)
 	values[index] = val;
 	return true;
 }
+bool closure::cached (int slot, value& out) const
+{
+	if (!filled[slot])
+		return false;
+	
+	out = values[closure_size + slot];
+	return true;
+}
+void closure::cache (int slot, const value& val)
+{
+	values[closure_size + slot] = val;
+	filled[slot] = true;
+}
+value& closure::slot (int s)
+{
+	return values[closure_size + s];
+}
+void closure::clear_cache ()
+{
+	for (int i = 0; i < cache_size; i++)
+		if (filled[i])
+		{
+			values[closure_size + i] = value();
+			filled[i] = false;
+		}
+}
+// closures made by the vm have no room for invariants, which are then
+// evaluated every time
+bool closure::invariant (int slot, value& out) const
+{
+	int i = cache_size + slot;
+	if (i >= (int)filled.size() || !filled[i])
+		return false;
+	
+	out = values[closure_size + i];
+	return true;
+}
+void closure::set_invariant (int slot, const value& val)
+{
+	int i = cache_size + slot;
+	if (i >= (int)filled.size())
+		return;
+	
+	values[closure_size + i] = val;
+	filled[i] = true;
+}
+void closure::keep_invariants (const closure& previous)
+{
+	if (previous.cache_size != cache_size || previous.filled.size() != filled.size())
+		return;
+	
+	for (int i = cache_size, size = filled.size(); i < size; i++)
+		if (previous.filled[i])
+		{
+			values[closure_size + i] = previous.values[previous.closure_size + i];
+			filled[i] = true;
+		}
+}
 int closure::size () const
 {
 	return closure_size;
@@ -2,6 +2,8 @@
 #include "error.h"
 #include "environment.h"
 
+#include <atomic>
+
 namespace xy {
 
 // TODO: implement closures
@@ -9,18 +11,143 @@ namespace xy {
 class closure;
 class value;
 class function;
+class vm;
+class lexer;
+class worker_pool;
+
+// a loaded program: the global environment holding its functions, and the
+// settings they are run with. any number of states may evaluate one program
+// at a time, each on its own thread; loading, and caching at call sites
+// (see call_expression::bind), are left to the first of them
+class program
+{
+public:
+	program ();
+	
+	inline environment& global () { return global_env; }
+	
+	// how many expressions of the loaded program have a proven type
+	// (see type_analysis), out of how many
+	inline void set_type_stats (int n, int p) { type_nodes = n; type_proven = p; }
+	inline int typed_nodes () const { return type_nodes; }
+	inline int proven_nodes () const { return type_proven; }
+
+private:
+	friend class state;
+	
+	environment global_env;
+	// set by the first state made for the program, which stays its
+	// primary one; no state is primary after it is destroyed
+	std::atomic<bool> claimed;
+	// states evaluating the program other than workers
+	std::atomic<int> states;
+	bool sealed;
+	
+	int max_depth;
+	size_t stack_size;
+	int engine;
+	bool jit;
+	int threads;
+	int type_nodes, type_proven;
+	
+	void import_native_functions (environment& env);
+};
 
+
+// a context evaluating a program on one thread: the errors raised there,
+// how deep its calls are nested, and the vm and workers it uses
 class state
 {
 public:
+	// a state loading a program of its own
 	state ();
+	// another state evaluating 'prog', which must outlive it
+	state (program& prog);
 	~state ();
 	
 	bool load (const std::string& filename);
+	bool load_string (const std::string& source);
+	// ends the loading of the program: its functions gain no more
+	// overloads, so the types of their results are proven along with
+	// the rest, and later loads fail
+	void seal ();
+	inline bool is_sealed () const { return prog.sealed; }
+	
+	// runs 'fn' on a separately allocated stack of stack_size() bytes, so
+	// that deep recursion is bounded by memory instead of the process stack
+	bool run (const std::function<bool()>& fn);
+	// bounds the recursion of evaluations with this state by the stack of
+	// the calling thread, which is then the only one to use it
+	void guard_stack ();
 	
 	
 	inline error_handler& error () { return err_handler; }
-	inline environment& global () { return global_env; }
+	inline program& loaded () { return prog; }
+	inline environment& global () { return prog.global_env; }
+	
+	inline void set_max_depth (int d) { prog.max_depth = d; }
+	inline void set_stack_size (size_t s) { prog.stack_size = s; }
+	inline int get_max_depth () const { return prog.max_depth; }
+	inline size_t get_stack_size () const { return prog.stack_size; }
+	
+	// how soft functions are run: by walking their expression trees, or
+	// from bytecode compiled on first call
+	enum engine_type
+	{
+		engine_tree = 0,
+		engine_vm
+	};
+	inline void set_engine (engine_type e) { prog.engine = e; }
+	inline engine_type get_engine () const { return engine_type(prog.engine); }
+	vm& machine ();
+	
+	// whether soft functions called with numbers only are compiled to
+	// machine code (see jit.h), which reads the limits below directly;
+	// only in the primary state, as the code refers to the limits of its
+	// compiler
+	inline void set_jit (bool j) { prog.jit = j; }
+	inline bool get_jit () const { return prog.jit && is_primary(); }
+	inline int* depth_address () { return &depth; }
+	inline const int* max_depth_address () const { return &prog.max_depth; }
+	inline const char* const* stack_limit_address () const { return &stack_limit; }
+	
+	// threads that parallel natives such as 'pmap' may use, counting the
+	// calling one; workers themselves have none to hand out to
+	inline void set_threads (int n) { prog.threads = n; }
+	inline int get_threads () const { return prog.threads; }
+	inline bool is_worker () const { return owner != nullptr; }
+	// how many states other than workers evaluate the program, such as
+	// those of the threads of a server
+	inline int program_states () const { return prog.states; }
+	worker_pool* workers ();
+	
+	// whether this is the state that loads the program and fills its
+	// caches; the others only read them
+	inline bool is_primary () const { return primary; }
+	
+	inline void set_type_stats (int n, int p) { prog.set_type_stats(n, p); }
+	inline int typed_nodes () const { return prog.type_nodes; }
+	inline int proven_nodes () const { return prog.type_proven; }
+	
+	// counts the nesting of XY function calls, failing cleanly with an
+	// error instead of overflowing the native stack
+	struct depth_guard
+	{
+		inline depth_guard (state& p)
+			: parent(p)
+		{
+			char probe;
+			parent.depth++;
+			good = parent.depth <= parent.prog.max_depth &&
+				(parent.stack_limit == nullptr || &probe > parent.stack_limit);
+		}
+		inline ~depth_guard () { parent.depth--; }
+		
+		bool check ();
+		
+		state& parent;
+		bool good;
+	};
 	
 	// meant to be a VERY simplistic class, why everything is inlined
 	struct scope
@@ -38,10 +165,23 @@ public:
 	
 	
 private:
+	friend class worker_pool;
+	
+	// a worker running parts of a parallel native for 'owner'
+	state (state& owner);
+	
+	std::shared_ptr<program> own;
+	program& prog;
+	state* owner;
+	bool primary;
+	
 	error_handler err_handler;
-	environment global_env;
+	int depth;
+	const char* stack_limit;
+	std::shared_ptr<vm> vm_engine;
+	std::shared_ptr<worker_pool> pool;
 	
-	void import_native_functions (environment& env);
+	bool load_from (lexer& lex);
 };
 
 
@@ -52,19 +192,34 @@ class closure
 {
 public:
 	closure (int size, const std::shared_ptr<closure>& parent =
-						std::shared_ptr<closure>(nullptr));
+						std::shared_ptr<closure>(nullptr), int cache_size = 0, int loop_size = 0);
 	closure (const argument_list& args, const std::shared_ptr<closure>& parent =
-						std::shared_ptr<closure>(nullptr));
+						std::shared_ptr<closure>(nullptr), int cache_size = 0, int loop_size = 0);
 	~closure ();
 	
 	value get (int index, int depth = 0);
 	bool set (int index, const value& val);	// muh stateless programming language
 	
+	// hidden slots holding common subexpressions, filled on first use
+	bool cached (int slot, value& out) const;
+	void cache (int slot, const value& val);
+	void clear_cache ();
+	
+	// hidden slots holding the arguments of inlined calls
+	value& slot (int s);
+	
+	// hidden slots holding loop invariants, filled on first use and kept
+	// across self tail calls (see soft_function::call)
+	bool invariant (int slot, value& out) const;
+	void set_invariant (int slot, const value& val);
+	void keep_invariants (const closure& previous);
+	
 	int size () const;
 private:
 	std::shared_ptr<closure> parent;
-	int closure_size;
+	int closure_size, cache_size;
 	value* values;
+	std::vector<bool> filled;
 };
 
 
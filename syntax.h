@@ -31,6 +31,7 @@
 #define SYNTAX_LAMBDA_R			'}'
 
 // a $ x : f(x) = g(x)
+// a $$ x : f(x) = g(x)  (on the workers, see lexer::token::plcomp_token)
 #define SYNTAX_LCOMP_SEP		'$'
 #define SYNTAX_LCOMP_FILTER		':'
 #define SYNTAX_LCOMP_MAP		'='
@@ -0,0 +1,31 @@
+#!/bin/sh
+# tests --each-line and --batch: void results are skipped, and with
+# --batch, list results are written one item per line; --batch needs a
+# positive number. usage: tests/each_line.sh [path to xy]
+
+XY=${1:-./xy}
+PROG=$(dirname "$0")/each_line.xy
+INPUT='a
+b
+
+
+c'
+
+fail ()
+{
+	echo "each-line test failed: $1" >&2
+	exit 1
+}
+
+out=$(printf '%s\n' "$INPUT" | "$XY" --each-line "$PROG") || fail "--each-line exited with $?"
+[ "$out" = "$(printf '<a>\n<b>\n<c>')" ] || fail "--each-line wrote '$out'"
+
+# batches [a, b], ["", ""] and [c]
+out=$(printf '%s\n' "$INPUT" | "$XY" --each-line --batch 2 "$PROG") || fail "--batch 2 exited with $?"
+[ "$out" = "$(printf '<a>\n<b>\n<c>')" ] || fail "--batch 2 wrote '$out'"
+
+for n in 0 -1 foo; do
+	echo | "$XY" --each-line --batch $n "$PROG" > /dev/null 2>&1 && fail "--batch $n was accepted"
+done
+
+echo "each-line test passed"
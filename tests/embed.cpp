@@ -0,0 +1,148 @@
+// tests the embedding API (see embed.h): failed loads and calls, calls of
+// one function with different numbers of arguments, later loads adding
+// overloads, and a state made for a program after the first one is gone.
+// built and run by 'make test'
+
+#include "include.h"
+#include "embed.h"
+#include "list.h"
+
+#include <iostream>
+
+static int failures = 0;
+
+static void check (bool ok, const std::string& what)
+{
+	if (!ok)
+	{
+		std::cerr << "embed test failed: " << what << std::endl;
+		failures++;
+	}
+}
+
+static bool number_result (const xy::status& st, xy::number n)
+{
+	return st.ok && st.result.type == xy::value::type_number && st.result.num == n;
+}
+
+static xy::value num (xy::number n) { return xy::value::from_number(n); }
+
+
+static void load_errors ()
+{
+	xy::state s;
+	s.guard_stack();
+
+	auto st = xy::load_string(s, "let f (x) = ");
+	check(!st && st.error.size() > 0, "a parse error loads");
+
+	st = xy::load_file(s, "tests/no such file.xy");
+	check(!st && st.error.size() > 0, "a missing file loads");
+
+	// the state is still usable
+	st = xy::load_string(s, "let g (x) = x + 1");
+	check(bool(st), "loading after a failed load: " + st.error);
+	check(number_result(xy::prepared_function(s, "g").call({ num(1) }), 2),
+		"calling after a failed load");
+}
+
+static void call_errors ()
+{
+	xy::state s;
+	s.guard_stack();
+	check(bool(xy::load_string(s, "let inv (n) = 1 / n")), "loading 'inv'");
+
+	xy::prepared_function inv(s, "inv");
+	check(inv.found(), "'inv' is found");
+
+	auto st = inv.call({ num(0) });
+	check(!st && st.error.find("divide by zero") != std::string::npos,
+		"inv(0) fails, with '" + st.error + "'");
+	check(number_result(inv.call({ num(4) }), 0.25), "inv(4) after a failure");
+
+	xy::prepared_function none(s, "none");
+	check(!none.found(), "'none' is not found");
+	st = none.call({});
+	check(!st && st.error.size() > 0, "calling 'none' fails");
+}
+
+static void arities ()
+{
+	xy::state s;
+	s.guard_stack();
+	// missing arguments are void, so the longest overload comes first
+	check(bool(xy::load_string(s,
+		"let sum (a : number?(a), b : number?(b), c : number?(c)) = a + b + c\n"
+		"let .. (a : number?(a), b : number?(b)) = a + b\n"
+		"let .. (a : number?(a)) = a\n"
+		"let .. () = 0\n")), "loading 'sum'");
+
+	xy::prepared_function sum(s, "sum");
+	check(number_result(sum.call({ num(1), num(2) }), 3), "sum(1, 2)");
+	check(number_result(sum.call({ num(1), num(2), num(3) }), 6), "sum(1, 2, 3)");
+	check(number_result(sum.call({ num(5) }), 5), "sum(5)");
+	check(number_result(sum.call({}), 0), "sum()");
+	check(number_result(sum.call({ num(4), num(4) }), 8), "sum(4, 4)");
+}
+
+// types proven in one load must hold after the next adds overloads
+static void later_loads ()
+{
+	xy::state s;
+	s.guard_stack();
+	check(bool(xy::load_string(s,
+		"let f (n : number?(n)) = 5\n"
+		"let g (x) = f(x) + 1\n")), "loading 'f' and 'g'");
+	check(bool(xy::load_string(s, "let f (s) = \"str\"")), "adding to 'f'");
+
+	xy::prepared_function g(s, "g");
+	auto st = g.call({ xy::value::from_string("q") });
+	check(st.ok && st.result.type == xy::value::type_string && st.result.str == "str1",
+		"g(\"q\") after adding to 'f' is '" + st.result.to_str() + "'");
+
+	s.seal();
+	check(number_result(g.call({ num(2) }), 6), "g(2) once sealed");
+	check(!xy::load_string(s, "let h () = 0"), "loading once sealed");
+}
+
+// compiled code refers to the state that compiled it, which must not be
+// used once destroyed
+static void later_state ()
+{
+	xy::program prog;
+	{
+		xy::state first(prog);
+		first.set_jit(true);
+		first.guard_stack();
+		check(bool(xy::load_string(first, "let f (n) = length(n) + 1")), "loading 'f'");
+
+		xy::prepared_function f(first, "f");
+		for (int i = 0; i < 10; i++)
+			f.call({ num(i) });
+	}
+
+	xy::state second(prog);
+	second.guard_stack();
+	xy::prepared_function f(second, "f");
+
+	auto st = f.call({ num(4) });
+	check(!st && st.error.size() > 0, "f(4) fails in a later state");
+
+	xy::value two(xy::value::from_list(xy::list::basic(std::vector<xy::value> { num(1), num(2) })));
+	check(number_result(f.call({ two }), 3), "f([1, 2]) in a later state");
+}
+
+
+int main ()
+{
+	load_errors();
+	call_errors();
+	arities();
+	later_loads();
+	later_state();
+
+	if (failures > 0)
+		return 1;
+	std::cout << "embed test passed" << std::endl;
+	return 0;
+}
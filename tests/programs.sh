@@ -0,0 +1,22 @@
+#!/bin/sh
+# runs each tests/*.xy that has a .out file beside it under every engine,
+# and with one thread or several, comparing the output. usage:
+# tests/programs.sh [path to xy]
+
+XY=${1:-./xy}
+DIR=$(dirname "$0")
+STATUS=0
+
+for prog in "$DIR"/*.xy; do
+	expected=${prog%.xy}.out
+	[ -f "$expected" ] || continue
+	for flags in "" "--jit" "--engine=vm" "--threads 1" "--threads 4"; do
+		if ! "$XY" $flags "$prog" 2>&1 | cmp -s - "$expected"; then
+			echo "$prog failed with flags '$flags'" >&2
+			STATUS=1
+		fi
+	done
+done
+
+[ $STATUS -eq 0 ] && echo "program tests passed"
+exit $STATUS
@@ -0,0 +1,44 @@
+#!/bin/sh
+# tests --serve and --request: replies, failures, and removing the socket
+# on SIGTERM. usage: tests/server.sh [path to xy]
+
+XY=${1:-./xy}
+DIR=$(mktemp -d)
+SOCKET=$DIR/xy.sock
+trap 'kill $PID 2> /dev/null; rm -rf "$DIR"' EXIT
+
+fail ()
+{
+	echo "server test failed: $1" >&2
+	exit 1
+}
+
+"$XY" --serve "$SOCKET" "$(dirname "$0")/server.xy" &
+PID=$!
+
+i=0
+while [ ! -S "$SOCKET" ]; do
+	i=$((i + 1))
+	[ $i -le 50 ] || fail "no socket after 5s"
+	kill -0 $PID 2> /dev/null || fail "server exited on start"
+	sleep 0.1
+done
+
+# the exit status of --request is that of the reply
+out=$("$XY" --request "$SOCKET" world 2> "$DIR/err") || fail "'world' failed"
+[ "$out" = "hello world" ] || fail "'world' replied '$out'"
+[ ! -s "$DIR/err" ] || fail "'world' wrote an error"
+
+out=$("$XY" --request "$SOCKET" fail 2> "$DIR/err") && fail "'fail' succeeded"
+[ -z "$out" ] || fail "'fail' replied '$out'"
+grep -q "bad request" "$DIR/err" || fail "'fail' replied '$(cat "$DIR/err")'"
+
+# failures do not stop the server
+out=$("$XY" --request "$SOCKET" again) || fail "'again' failed"
+[ "$out" = "hello again" ] || fail "'again' replied '$out'"
+
+kill -TERM $PID
+wait $PID || fail "server exited with status $?"
+[ ! -e "$SOCKET" ] || fail "socket left behind"
+
+echo "server test passed"
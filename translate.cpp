@@ -0,0 +1,699 @@
+#include "include.h"
+#include "translate.h"
+#include "expression.h"
+#include "function.h"
+#include "list.h"
+#include "lexer.h"
+
+namespace xy {
+
+
+// larger constant lists are left to the interpreter
+#define XY_CPP_MAX_LIST 4096
+
+
+static std::string quote (const std::string& s)
+{
+	std::ostringstream ss;
+	ss << '"';
+	for (unsigned char c : s)
+		switch (c)
+		{
+		case '"':  ss << "\\\""; break;
+		case '\\': ss << "\\\\"; break;
+		case '\n': ss << "\\n"; break;
+		case '\t': ss << "\\t"; break;
+		default:
+			if (c < 32 || c >= 127)
+			{
+				char buf[8];
+				snprintf(buf, sizeof(buf), "\\%03o", c);
+				ss << buf;
+			}
+			else
+				ss << c;
+		}
+	ss << '"';
+	return ss.str();
+}
+
+static std::string number_literal (number n)
+{
+	if (std::isnan(n))
+		return "NAN";
+	if (std::isinf(n))
+		return n > 0 ? "HUGE_VAL" : "-HUGE_VAL";
+	
+	std::ostringstream ss;
+	ss.precision(17);
+	ss << n;
+	if (ss.str().find_first_of(".e") == std::string::npos)
+		ss << ".0";
+	return ss.str();
+}
+
+static std::string operator_literal (int op)
+{
+	if (op > ' ' && op < 127)
+		return std::string("'") + (char)op + "'";
+	return std::to_string(op);
+}
+
+
+
+
+
+
+cpp_writer::cpp_writer (state& s)
+	: parent(s), max_params(1), direct_calls(false), func(nullptr), nparams(0),
+	  indent(0), temps(0), recurs(false)
+{ }
+
+bool cpp_writer::translate (state& s, const std::string& filename, std::ostream& out)
+{
+	std::ifstream file(filename);
+	if (!file)
+	{
+		s.error().die() << "Could not read file '" << filename << "'";
+		return false;
+	}
+	std::ostringstream source;
+	source << file.rdbuf();
+	
+	cpp_writer w(s);
+	
+	// first find the functions that translate with calls between them left
+	// generic, then write them again calling each other directly
+	std::vector<soft_function*> good;
+	for (auto& f : s.global().functions())
+		if (!f->is_native())
+		{
+			auto soft = static_cast<soft_function*>(f.get());
+			std::ostringstream ignored;
+			if (w.function_body(soft, ignored))
+				good.push_back(soft);
+		}
+	
+	w.globals.clear();
+	w.consts.clear();
+	w.const_index.clear();
+	for (auto f : good)
+	{
+		w.func_index[f] = w.funcs.size();
+		w.funcs.push_back(f);
+		if (f->bodies()[0]->params.size() > w.max_params)
+			w.max_params = f->bodies()[0]->params.size();
+	}
+	
+	std::ostringstream bodies;
+	for (auto f : w.funcs)
+		if (!w.function_body(f, bodies))
+			return false;
+	
+	
+	out << "// generated by 'xy --emit-cpp " << filename << "'\n"
+	    << "#include \"include.h\"\n"
+	    << "#include \"state.h\"\n"
+	    << "#include \"value.h\"\n"
+	    << "#include \"function.h\"\n"
+	    << "#include \"environment.h\"\n"
+	    << "#include \"list.h\"\n"
+	    << "\n"
+	    << "using namespace xy;\n"
+	    << "\n"
+	    << "#define XY_MAX_PARAMS " << w.max_params << "\n"
+	    << "\n"
+	    << "static const char* xy_source =\n";
+	
+	std::istringstream lines(source.str());
+	std::string text;
+	while (std::getline(lines, text))
+		out << "\t" << quote(text + "\n") << "\n";
+	out << "\t\"\";\n\n";
+	
+	out << "static const char* xy_global_names[] = {";
+	for (auto& g : w.globals)
+		out << " " << quote(g) << ",";
+	out << " nullptr };\n"
+	    << "static std::shared_ptr<function> xy_global[" << w.globals.size() + 1 << "];\n"
+	    << "static value xy_const[" << w.consts.size() + 1 << "];\n"
+	    << "\n"
+	    << "typedef int (*xy_body)(value& out, value* a, int& next, state& s);\n";
+	for (int k = 0; k < (int)w.funcs.size(); k++)
+		out << "static int xy_body_" << k << " (value& out, value* a, int& next, state& s);\n";
+	out << "\n"
+	    << "static xy_body xy_bodies[] = {";
+	for (int k = 0; k < (int)w.funcs.size(); k++)
+		out << " &xy_body_" << k << ",";
+	out << " nullptr };\n";
+	
+	// helpers are only written when the code uses them, to compile cleanly
+	if (w.funcs.size() > 0)
+	{
+		out << "static const char* xy_names[] = {";
+		for (auto f : w.funcs)
+			out << " " << quote(f->name()) << ",";
+		out << " nullptr };\n";
+	}
+	out << "\n"
+	    << "\n"
+	    << "static value xy_list (const std::vector<value>& items)\n"
+	    << "{\n"
+	    << "\treturn value::from_list(items.size() == 0 ? list::empty() : list::basic(items));\n"
+	    << "}\n"
+	    << "\n";
+	if (w.funcs.size() > 0)
+		out << "static bool xy_no_overload (state& s, const char* name)\n"
+		    << "{\n"
+		    << "\ts.error().die() << \"No suitable overload for function '\" << name << \"' found\";\n"
+		    << "\treturn false;\n"
+		    << "}\n"
+		    << "\n";
+	out << "// bodies return 0 on errors, 1 with a result, and 2 for a tail call to\n"
+	    << "// function 'next' with its arguments in 'a'\n"
+	    << "static bool xy_run (int k, value& out, value* a, state& s)\n"
+	    << "{\n"
+	    << "\tfor (;;)\n"
+	    << "\t\tswitch (xy_bodies[k](out, a, k, s))\n"
+	    << "\t\t{\n"
+	    << "\t\tcase 0: return false;\n"
+	    << "\t\tcase 1: return true;\n"
+	    << "\t\t}\n"
+	    << "}\n"
+	    << "\n";
+	if (w.direct_calls)
+		out << "static bool xy_direct (int k, value& out, std::initializer_list<value> args, state& s)\n"
+		    << "{\n"
+		    << "\tstate::depth_guard depth(s);\n"
+		    << "\tif (!depth.check())\n"
+		    << "\t\treturn false;\n"
+		    << "\tvalue a[XY_MAX_PARAMS];\n"
+		    << "\tstd::copy(args.begin(), args.end(), a);\n"
+		    << "\treturn xy_run(k, out, a, s);\n"
+		    << "}\n"
+		    << "\n";
+	out << "template <int K>\n"
+	    << "static bool xy_entry (value& out, const argument_list& args, state& s)\n"
+	    << "{\n"
+	    << "\tvalue a[XY_MAX_PARAMS];\n"
+	    << "\tstd::copy(args.values, args.values + args.size, a);\n"
+	    << "\treturn xy_run(K, out, a, s);\n"
+	    << "}\n"
+	    << "\n"
+	    << "\n"
+	    << bodies.str()
+	    << "\n"
+	    << "\n"
+	    << "static bool xy_install (state& s)\n"
+	    << "{\n"
+	    << "\tfor (int i = 0; xy_global_names[i] != nullptr; i++)\n"
+	    << "\t\tif ((xy_global[i] = s.global().find_function(xy_global_names[i])) == nullptr)\n"
+	    << "\t\t{\n"
+	    << "\t\t\ts.error().die() << \"Missing function '\" << xy_global_names[i] << \"'\";\n"
+	    << "\t\t\treturn false;\n"
+	    << "\t\t}\n"
+	    << "\t\n";
+	for (int i = 0; i < (int)w.consts.size(); i++)
+		out << "\txy_const[" << i << "] = " << w.consts[i] << ";\n";
+	out << "\t\n";
+	if (w.funcs.size() > 0)
+		out << "\tsoft_function* f;\n";
+	for (int k = 0; k < (int)w.funcs.size(); k++)
+		out << "\tf = static_cast<soft_function*>(s.global().find_function(xy_names[" << k << "]).get());\n"
+		    << "\tf->set_compiled(&xy_entry<" << k << ">, "
+		    << w.funcs[k]->bodies()[0]->params.size() << ");\n";
+	out << "\treturn true;\n"
+	    << "}\n"
+	    << "\n"
+	    << "int main (int argc, char** argv)\n"
+	    << "{\n"
+	    << "\tstate xy;\n"
+	    << "\t\n"
+	    << "\tif (!xy.run([&] () -> bool\n"
+	    << "\t{\n"
+	    << "\t\tif (!xy.load_string(xy_source) || !xy_install(xy))\n"
+	    << "\t\t\treturn false;\n"
+	    << "\t\t\n"
+	    << "\t\tauto main_func = xy.global().find_function(\"main\");\n"
+	    << "\t\tif (main_func == nullptr)\n"
+	    << "\t\t{\n"
+	    << "\t\t\tstd::cout << \"no main function found\" << std::endl;\n"
+	    << "\t\t\treturn true;\n"
+	    << "\t\t}\n"
+	    << "\t\t\n"
+	    << "\t\tstd::vector<value> arg_strings;\n"
+	    << "\t\tfor (int i = 1; i < argc; i++)\n"
+	    << "\t\t\targ_strings.push_back(value::from_string(std::string(argv[i])));\n"
+	    << "\t\t\n"
+	    << "\t\tvalue output;\n"
+	    << "\t\treturn main_func->call(output, { xy_list(arg_strings) }, xy);\n"
+	    << "\t}))\n"
+	    << "\t{\n"
+	    << "\t\txy.error().dump();\n"
+	    << "\t\treturn -1;\n"
+	    << "\t}\n"
+	    << "\treturn 0;\n"
+	    << "}\n";
+	return true;
+}
+
+// writes 'f' as function xy_body_<index>; its parameters live in 'a', which
+// a tail call overwrites, and hidden slots in a local array
+bool cpp_writer::function_body (soft_function* f, std::ostream& out)
+{
+	auto& bodies = f->bodies();
+	if (f->is_lambda() || bodies.size() == 0)
+		return false;
+	
+	func = f;
+	nparams = bodies[0]->params.size();
+	code.str("");
+	indent = 1;
+	temps = 0;
+	recurs = false;
+	literals.clear();
+	
+	int nslots = 0;
+	for (auto& b : bodies)
+	{
+		if (b->params.size() != nparams)
+			return false;
+		if (b->cache_size > nslots)
+			nslots = b->cache_size;
+	}
+	
+	for (int o = 0; o < (int)bodies.size(); o++)
+	{
+		auto& b = bodies[o];
+		bool guarded = false;
+		
+		if (b->cache_size > 0)
+			line() << "for (auto& f : filled) f = false;\n";
+		
+		for (int i = 0; i < nparams; i++)
+		{
+			auto& cond = b->params.condition(i);
+			if (cond == nullptr)
+				continue;
+			
+			std::string r;
+			if (!cond->emit_cpp(*this, r, false))
+				return false;
+			line() << "if (!" << r << ".condition())\n";
+			line() << "\tgoto next_" << o << ";\n";
+			guarded = true;
+		}
+		
+		std::string r;
+		if (!b->body->emit_cpp(*this, r, true))
+			return false;
+		if (r.size() > 0)
+		{
+			line() << "out = " << r << ";\n";
+			line() << "return 1;\n";
+		}
+		
+		if (guarded)
+			code << "next_" << o << ":\n";
+	}
+	line() << "return xy_no_overload(s, xy_names[" <<
+		(func_index.count(f) ? func_index[f] : 0) << "]);\n";
+	
+	
+	out << "// " << f->name() << "\n"
+	    << "static int xy_body_" << (func_index.count(f) ? func_index[f] : 0)
+	    << " (value& out, value* a, int& next, state& s)\n"
+	    << "{\n";
+	if (temps > 0)
+	{
+		out << "\tvalue";
+		for (int i = 0; i < temps; i++)
+			out << (i > 0 ? ", t" : " t") << i;
+		out << ";\n";
+	}
+	if (nslots > 0)
+		out << "\tvalue slot[" << nslots << "];\n"
+		    << "\tbool filled[" << nslots << "];\n";
+	if (recurs)
+		out << "recur:\n";
+	out << code.str()
+	    << "}\n\n";
+	return true;
+}
+
+std::ostream& cpp_writer::line ()
+{
+	for (int i = 0; i < indent; i++)
+		code << '\t';
+	return code;
+}
+
+std::string cpp_writer::temp ()
+{
+	return "t" + std::to_string(temps++);
+}
+
+// the number held by a value already known to be one
+std::string cpp_writer::number_of (const std::string& result)
+{
+	auto it = literals.find(result);
+	if (it != literals.end())
+		return it->second;
+	return result + ".num";
+}
+
+// arguments that name parameters are copied first, as 'a' is overwritten
+bool cpp_writer::tail_args (const std::vector<std::string>& args)
+{
+	std::vector<std::string> vals(args);
+	for (auto& v : vals)
+		if (v.compare(0, 2, "a[") == 0)
+		{
+			auto t = temp();
+			line() << t << " = " << v << ";\n";
+			v = t;
+		}
+	for (int i = 0; i < (int)vals.size(); i++)
+		line() << "a[" << i << "] = " << vals[i] << ";\n";
+	return true;
+}
+
+int cpp_writer::global (const std::string& name)
+{
+	for (int i = 0; i < (int)globals.size(); i++)
+		if (globals[i] == name)
+			return i;
+	globals.push_back(name);
+	return globals.size() - 1;
+}
+
+// an expression building 'v' at startup
+bool cpp_writer::initializer (std::string& out, const value& v)
+{
+	switch (v.type)
+	{
+	case value::type_void:
+		out = "value()";
+		return true;
+	case value::type_number:
+		out = "value::from_number(" + number_literal(v.num) + ")";
+		return true;
+	case value::type_bool:
+		out = v.cond ? "value::from_bool(true)" : "value::from_bool(false)";
+		return true;
+	case value::type_string:
+		out = "value::from_string(std::string(" + quote(v.str) + ", " +
+			std::to_string(v.str.size()) + "))";
+		return true;
+	
+	case value::type_function:
+		// only globals can be found again by name
+		if (v.func_obj->is_lambda() ||
+				parent.global().find_function(v.func_obj->name()) != v.func_obj)
+			return false;
+		out = "value::from_function(xy_global[" +
+			std::to_string(global(v.func_obj->name())) + "])";
+		return true;
+	
+	case value::type_list:
+	{
+		int size = v.list_obj->size();
+		if (size > XY_CPP_MAX_LIST)
+			return false;
+		
+		out = "xy_list({";
+		for (int i = 0; i < size; i++)
+		{
+			std::string item;
+			if (!initializer(item, v.list_obj->get(i)))
+				return false;
+			out += (i > 0 ? ", " : " ") + item;
+		}
+		out += " })";
+		return true;
+	}
+	
+	default:
+		return false;
+	}
+}
+
+
+
+
+
+
+bool cpp_writer::constant (std::string& result, const value& v)
+{
+	std::string init;
+	if (!initializer(init, v))
+		return false;
+	
+	auto it = const_index.find(init);
+	if (it == const_index.end())
+	{
+		it = const_index.insert({ init, consts.size() }).first;
+		consts.push_back(init);
+	}
+	
+	result = "xy_const[" + std::to_string(it->second) + "]";
+	if (v.type == value::type_number)
+		literals[result] = number_literal(v.num);
+	return true;
+}
+
+bool cpp_writer::local (std::string& result, int index, int depth)
+{
+	if (depth != 0 || index < 0 || index >= nparams)
+		return false;
+	result = "a[" + std::to_string(index) + "]";
+	return true;
+}
+
+bool cpp_writer::slot (std::string& result, int s)
+{
+	result = "slot[" + std::to_string(s) + "]";
+	return true;
+}
+
+bool cpp_writer::bind_slot (int s, expression& val)
+{
+	std::string r;
+	if (!val.emit_cpp(*this, r, false))
+		return false;
+	line() << "slot[" << s << "] = " << r << ";\n";
+	return true;
+}
+
+bool cpp_writer::cached (std::string& result, int s, expression& e)
+{
+	line() << "if (!filled[" << s << "])\n";
+	line() << "{\n";
+	indent++;
+	std::string r;
+	if (!e.emit_cpp(*this, r, false))
+		return false;
+	line() << "slot[" << s << "] = " << r << ";\n";
+	line() << "filled[" << s << "] = true;\n";
+	indent--;
+	line() << "}\n";
+	
+	result = "slot[" + std::to_string(s) + "]";
+	return true;
+}
+
+bool cpp_writer::unary (std::string& result, int op, expression& a)
+{
+	std::string ra;
+	if (!a.emit_cpp(*this, ra, false))
+		return false;
+	
+	result = temp();
+	if (op == '-')
+	{
+		line() << "if (" << (a.proven_type() == value::type_number ? "true" :
+			ra + ".type == value::type_number") << ")\n";
+		line() << "\t" << result << " = value::from_number(-" << ra << ".num);\n";
+		line() << "else if (!" << ra << ".apply_unary(" << result << ", '-', s))\n";
+	}
+	else
+		line() << "if (!" << ra << ".apply_unary(" << result << ", "
+			<< operator_literal(op) << ", s))\n";
+	line() << "\treturn 0;\n";
+	return true;
+}
+
+bool cpp_writer::binary (std::string& result, int op, expression& a, expression& b, bool tail)
+{
+	std::string ra, rb;
+	if (!a.emit_cpp(*this, ra, false))
+		return false;
+	
+	if (op == lexer::token::keyword_and ||
+			op == lexer::token::keyword_or)
+	{
+		result = temp();
+		line() << "if (" << (op == lexer::token::keyword_and ? "!" : "")
+			<< ra << ".condition())\n";
+		line() << "\t" << result << " = " << ra << ";\n";
+		line() << "else\n";
+		line() << "{\n";
+		indent++;
+		if (!b.emit_cpp(*this, rb, tail))
+			return false;
+		if (rb.size() > 0)
+			line() << result << " = " << rb << ";\n";
+		indent--;
+		line() << "}\n";
+		return true;
+	}
+	
+	// the interpreter runs '[x] + f(y)' in constant stack space
+	if (tail && op == '+' && a.is_list_literal() != b.is_list_literal())
+		return false;
+	
+	if (!b.emit_cpp(*this, rb, false))
+		return false;
+	
+	// as in number_operator, with the generic path for anything else
+	std::string x = number_of(ra), y = number_of(rb), fast;
+	bool divides = false;
+	switch (op)
+	{
+	case '+': fast = "value::from_number(" + x + " + " + y + ")"; break;
+	case '-': fast = "value::from_number(" + x + " - " + y + ")"; break;
+	case '*': fast = "value::from_number(" + x + " * " + y + ")"; break;
+	case '^': fast = "value::from_number(pow(" + x + ", " + y + "))"; break;
+	case '/':
+		fast = "value::from_number(" + x + " / " + y + ")";
+		divides = true;
+		break;
+	case '%':
+		fast = "value::from_number(" + x + " - (int)(" + x + " / " + y + ") * " + y + ")";
+		divides = true;
+		break;
+	case lexer::token::eql_token:
+		fast = "value::from_bool(" + x + " == " + y + ")";
+		break;
+	case '>':
+		fast = "value::from_bool(" + x + " > " + y + ")";
+		break;
+	case '<':
+		fast = "value::from_bool(!(" + x + " == " + y + " || " + x + " > " + y + "))";
+		break;
+	case lexer::token::gre_token:
+		fast = "value::from_bool(" + x + " == " + y + " || " + x + " > " + y + ")";
+		break;
+	case lexer::token::lse_token:
+		fast = "value::from_bool(!(" + x + " > " + y + "))";
+		break;
+	default:
+		break;
+	}
+	
+	result = temp();
+	if (fast.size() > 0)
+	{
+		std::vector<std::string> conds;
+		if (!literals.count(ra) && a.proven_type() != value::type_number)
+			conds.push_back(ra + ".type == value::type_number");
+		if (!literals.count(rb) && b.proven_type() != value::type_number)
+			conds.push_back(rb + ".type == value::type_number");
+		if (divides)
+			conds.push_back(y + " != 0");
+		
+		std::string test = conds.size() > 0 ? conds[0] : "true";
+		for (int i = 1; i < (int)conds.size(); i++)
+			test += " && " + conds[i];
+		
+		line() << "if (" << test << ")\n";
+		line() << "\t" << result << " = " << fast << ";\n";
+		line() << "else if (!" << ra << ".apply_operator(" << result << ", "
+			<< operator_literal(op) << ", " << rb << ", s))\n";
+	}
+	else
+		line() << "if (!" << ra << ".apply_operator(" << result << ", "
+			<< operator_literal(op) << ", " << rb << ", s))\n";
+	line() << "\treturn 0;\n";
+	return true;
+}
+
+bool cpp_writer::call (std::string& result, expression& callee, const child_values& args, bool tail)
+{
+	std::vector<std::string> vals;
+	for (auto& e : args)
+	{
+		std::string r;
+		if (!e->emit_cpp(*this, r, false))
+			return false;
+		vals.push_back(r);
+	}
+	
+	std::string joined;
+	for (int i = 0; i < (int)vals.size(); i++)
+		joined += (i > 0 ? ", " : "") + vals[i];
+	
+	auto v = callee.const_value();
+	if (v != nullptr && v->type == value::type_function && !v->func_obj->is_native())
+	{
+		auto f = static_cast<soft_function*>(v->func_obj.get());
+		bool direct = f->memo() == nullptr && func_index.count(f) > 0 &&
+			f->bodies()[0]->params.size() == (int)vals.size();
+		
+		// self tail calls loop, tail calls to other translated functions
+		// go back to xy_run, and other calls to them skip the lookup
+		if (f == func && tail && (int)vals.size() == nparams && f->memo() == nullptr)
+		{
+			tail_args(vals);
+			line() << "goto recur;\n";
+			recurs = true;
+			result = "";
+			return true;
+		}
+		if (direct && tail)
+		{
+			tail_args(vals);
+			line() << "next = " << func_index[f] << ";\n";
+			line() << "return 2;\n";
+			result = "";
+			return true;
+		}
+		if (direct)
+		{
+			result = temp();
+			direct_calls = true;
+			line() << "if (!xy_direct(" << func_index[f] << ", " << result
+				<< ", { " << joined << " }, s))\n";
+			line() << "\treturn 0;\n";
+			return true;
+		}
+	}
+	
+	std::string rf;
+	if (!callee.emit_cpp(*this, rf, false))
+		return false;
+	
+	result = temp();
+	line() << "if (!" << rf << ".call(" << result << ", { " << joined << " }, s))\n";
+	line() << "\treturn 0;\n";
+	return true;
+}
+
+bool cpp_writer::list (std::string& result, const child_values& items)
+{
+	std::string joined;
+	for (auto& e : items)
+	{
+		std::string r;
+		if (!e->emit_cpp(*this, r, false))
+			return false;
+		joined += (joined.size() > 0 ? ", " : "") + r;
+	}
+	
+	result = temp();
+	line() << result << " = xy_list({ " << joined << " });\n";
+	return true;
+}
+
+
+};
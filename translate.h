@@ -0,0 +1,68 @@
+#pragma once
+#include "state.h"
+#include "value.h"
+
+#include <map>
+
+namespace xy {
+
+class expression;
+class soft_function;
+typedef std::vector<std::shared_ptr<expression>> child_values;
+
+
+// writes a loaded program as a C++ translation unit for 'make native'. every
+// global soft function whose expressions are all covered becomes a C++
+// function on the value runtime, installed over its overloads when the
+// embedded source is loaded at startup; anything else stays interpreted
+class cpp_writer
+{
+public:
+	static bool translate (state& s, const std::string& filename, std::ostream& out);
+	
+	// expressions translate themselves through these (see
+	// expression::emit_cpp), writing any statements they need and leaving
+	// in 'result' the name of their value; an empty name after a tail call
+	bool constant (std::string& result, const value& v);
+	bool local (std::string& result, int index, int depth);
+	bool slot (std::string& result, int s);
+	bool bind_slot (int s, expression& val);
+	bool cached (std::string& result, int s, expression& e);
+	bool unary (std::string& result, int op, expression& a);
+	bool binary (std::string& result, int op, expression& a, expression& b, bool tail);
+	bool call (std::string& result, expression& callee, const child_values& args, bool tail);
+	bool list (std::string& result, const child_values& items);
+
+private:
+	cpp_writer (state& s);
+	
+	state& parent;
+	
+	// translated functions, and the globals and constants they refer to
+	std::vector<soft_function*> funcs;
+	std::map<soft_function*, int> func_index;
+	std::vector<std::string> globals;
+	std::vector<std::string> consts;
+	std::map<std::string, int> const_index;
+	int max_params;
+	bool direct_calls; // whether any go through xy_direct
+	
+	// the function being written
+	soft_function* func;
+	int nparams;
+	std::ostringstream code;
+	int indent, temps;
+	bool recurs;
+	std::map<std::string, std::string> literals; // numbers, by name
+	
+	bool function_body (soft_function* f, std::ostream& out);
+	std::ostream& line ();
+	std::string temp ();
+	std::string number_of (const std::string& result);
+	bool tail_args (const std::vector<std::string>& args);
+	int global (const std::string& name);
+	bool initializer (std::string& out, const value& v);
+};
+
+
+};
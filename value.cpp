@@ -24,6 +24,7 @@ value::value (const value& other)
 	case type_number: 	num = other.num; break;
 	case type_function:	func_obj = other.func_obj; break;
 	case type_map:      map_obj = other.map_obj; break;
+	case type_future:   future_obj = other.future_obj; break;
 	default: break;
 	}
 }
@@ -38,6 +39,7 @@ value& value::operator=(const value& other)
 	case type_number: 	num = other.num; break;
 	case type_function:	func_obj = other.func_obj; break;
 	case type_map:      map_obj = other.map_obj; break;
+	case type_future:   future_obj = other.future_obj; break;
 	default: break;
 	}
 	return *this;
@@ -94,6 +96,9 @@ std::string value::to_str () const
 	case type_map:
 		return "<map object>";
 	
+	case type_future:
+		return "<future>";
+	
 	default:
 		return "??";
 	}
@@ -139,6 +144,12 @@ value value::from_map (const std::shared_ptr<map>& m)
 	v.map_obj = m;
 	return v;
 }
+value value::from_future (const std::shared_ptr<future>& f)
+{
+	value v(type_future);
+	v.future_obj = f;
+	return v;
+}
 
 
 bool value::apply_operator (value& out, int op, const value& other, state& parent)
@@ -377,7 +388,7 @@ bad_input:
 	return false;
 }
 
-value::comparison value::compare (const value& other, state& parent)
+value::comparison value::compare (const value& other, state& parent) const
 {
 	if (type != other.type)
 		return compare_none;
@@ -402,12 +413,85 @@ value::comparison value::compare (const value& other, state& parent)
 		
 	case type_string:
 		return (str == other.str) ? compare_equal : compare_none;
-		
+	
 	default:
 		return compare_none;
 	};
 }
 
+bool value::same_key (const value& other, state& parent) const
+{
+	if (type != other.type)
+		return false;
+	
+	switch (type)
+	{
+	case type_list:
+		{
+			int size = list_obj->size();
+			if (size != other.list_obj->size())
+				return false;
+			for (int i = 0; i < size; i++)
+				if (!list_obj->get(i).same_key(other.list_obj->get(i), parent))
+					return false;
+			return true;
+		}
+	
+	case type_map:
+		return map_obj->same_key(other.map_obj, parent);
+	
+	case type_function:
+		return func_obj == other.func_obj;
+	
+	case type_future:
+		return future_obj == other.future_obj;
+	
+	default:
+		return equals(other, parent);
+	}
+}
+
+
+uint64_t value::hash_code () const
+{
+	const uint64_t prime = 1099511628211ULL;
+	uint64_t h = 14695981039346656037ULL ^ (uint64_t)(type);
+	
+	switch (type)
+	{
+	case type_number:
+		{
+			number n = (num == 0) ? 0 : num; // -0 == 0
+			uint64_t bits;
+			std::memcpy(&bits, &n, sizeof(bits));
+			return (h ^ bits) * prime;
+		}
+	
+	case type_bool:
+		return (h ^ (cond ? 1 : 0)) * prime;
+	
+	case type_string:
+		return map::get_hash(str) ^ h;
+	
+	case type_list:
+		for (int i = 0, size = list_obj->size(); i < size; i++)
+			h = (h ^ list_obj->get(i).hash_code()) * prime;
+		return h;
+	
+	case type_map:
+		return h ^ map_obj->hash_code();
+	
+	case type_function:
+		return (h ^ (uint64_t)(uintptr_t)(func_obj.get())) * prime;
+	
+	case type_future:
+		return (h ^ (uint64_t)(uintptr_t)(future_obj.get())) * prime;
+	
+	default:
+		return h;
+	}
+}
+
 
 bool value::call (value& out, const argument_list& args, state& parent)
 {
@@ -511,6 +595,7 @@ std::string value::type_str (value_type t)
 	case type_string: return "string";
 	case type_function: return "function";
 	case type_map: return "map";
+	case type_future: return "future";
 	
 	case type_int: return "integer";
 	case type_iterable: return "iterable";
@@ -7,6 +7,7 @@ class function;
 class error_handler;
 class list;
 class map;
+class future;
 struct argument_list;
 
 struct value
@@ -21,6 +22,7 @@ struct value
 		type_list,
 		type_string,
 		type_map,
+		type_future,
 		
 		// ambiguous types
 		type_int,
@@ -50,6 +52,7 @@ struct value
 	std::shared_ptr<function> func_obj;
 	std::shared_ptr<list> list_obj;
 	std::shared_ptr<map> map_obj;
+	std::shared_ptr<future> future_obj;
 	std::string str;
 	
 	
@@ -58,12 +61,15 @@ struct value
 	
 	bool apply_operator (value& out, int op, const value& other, state& parent);
 	bool apply_unary (value& out, int op, state& parent);
-	comparison compare (const value& other, state& parent);
+	comparison compare (const value& other, state& parent) const;
 	
-	inline bool equals (const value& other, state& parent)
+	inline bool equals (const value& other, state& parent) const
 	{
 		return compare(other, parent) & compare_equal;
 	}
+	// equality of memo table and set keys; unlike '==', maps are equal
+	// by content and functions by identity
+	bool same_key (const value& other, state& parent) const;
 	
 	
 	bool call (value& out, const argument_list& args, state& parent);
@@ -72,6 +78,22 @@ struct value
 	
 	bool is_type (value_type t) const;
 	std::string to_str () const;
+	
+	// structural hash, consistent with same_key(): lists, maps and strings
+	// are hashed by content, functions by identity
+	uint64_t hash_code () const;
+	
+	// for use as the key of standard hash containers
+	struct hasher
+	{
+		inline size_t operator() (const value& v) const { return (size_t)(v.hash_code()); }
+	};
+	struct equal_to
+	{
+		inline equal_to (state& s) : parent(&s) {}
+		inline bool operator() (const value& a, const value& b) const { return a.same_key(b, *parent); }
+		state* parent;
+	};
 	std::string type_str () const;
 	
 	
@@ -86,6 +108,7 @@ struct value
 	static value from_function (const std::shared_ptr<function>& f);
 	static value from_list (const std::shared_ptr<list>& l);
 	static value from_map (const std::shared_ptr<map>& m);
+	static value from_future (const std::shared_ptr<future>& f);
 	
 	static std::string type_str (value_type t);
 	static std::string true_string ();
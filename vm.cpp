@@ -0,0 +1,423 @@
+#include "include.h"
+#include "vm.h"
+#include "expression.h"
+#include "function.h"
+#include "list.h"
+
+namespace xy {
+
+
+int bytecode::emit (opcode op, int a, int b)
+{
+	code.push_back({ op, a, b });
+	return code.size() - 1;
+}
+void bytecode::patch (int at)
+{
+	code[at].b = code.size();
+}
+int bytecode::add_const (const value& v)
+{
+	constants.push_back(v);
+	return constants.size() - 1;
+}
+int bytecode::add_node (expression* e)
+{
+	nodes.push_back(e);
+	return nodes.size() - 1;
+}
+
+std::shared_ptr<bytecode> bytecode::compile (func_body& body)
+{
+	std::shared_ptr<bytecode> out(new bytecode());
+
+	for (int i = 0; i < body.params.size(); i++)
+		if (body.params.condition(i) != nullptr)
+		{
+			body.params.condition(i)->compile(*out, false);
+			out->emit(op_guard);
+		}
+
+	body.body->compile(*out, true);
+	out->emit(op_return);
+	return out;
+}
+
+
+
+
+
+
+vm::vm (state& p)
+	: parent(p)
+{ }
+
+bool vm::call (value& out, soft_function* f, const argument_list& args)
+{
+	size_t base = frames.size(), stack_start = stack.size();
+
+	stack.push_back(value());
+	for (int i = 0; i < args.size; i++)
+		stack.push_back(args.values[i]);
+
+	bool good = push_frame(f, nullptr, args.size) && run(out, base);
+	frames.resize(base);
+	stack.resize(stack_start);
+	return good;
+}
+
+// the top 'nargs' values of the stack become the closure of the new frame,
+// which returns its value in place of the callee below them
+bool vm::push_frame (soft_function* f, const std::shared_ptr<function>& ref, int nargs)
+{
+	if ((int)frames.size() >= parent.get_max_depth())
+	{
+		parent.error().die()
+			<< "Maximum recursion depth exceeded (" << parent.get_max_depth() << ")";
+		return false;
+	}
+	// the frames get the memory the tree interpreter's stack would have
+	if (frames.size() * frame_bytes + stack.size() * sizeof(value) > parent.get_stack_size())
+	{
+		parent.error().die()
+			<< "Stack space exhausted at recursion depth " << frames.size();
+		return false;
+	}
+
+	size_t first = stack.size() - nargs;
+	std::shared_ptr<closure> local(new closure(nargs, f->parent_closure, f->closure_cache_size()));
+	for (int i = 0; i < nargs; i++)
+		local->set(i, stack[first + i]);
+	stack.resize(first);
+
+	frames.push_back({ f, ref, local, 0, nullptr, nullptr, first, {} });
+	return enter(frames.back(), 0);
+}
+
+bool vm::enter (frame& fr, int overload)
+{
+	auto& bodies = fr.func->bodies();
+	if (overload >= (int)bodies.size())
+	{
+		auto& err = parent.error().die();
+		err << "No suitable overload for ";
+		if (fr.func->is_lambda())
+			err << "lambda function";
+		else
+			err << "function '" << fr.func->name() << "'";
+		err << " found";
+		return false;
+	}
+
+	auto& body = bodies[overload];
+	std::call_once(body->compile_once, [&] { body->compiled = bytecode::compile(*body); });
+
+	if (fr.func->cache_size > 0)
+		fr.local->clear_cache();
+
+	fr.overload = overload;
+	fr.code = body->compiled.get();
+	fr.ip = fr.code->code.data();
+	stack.resize(fr.stack_base);
+	return true;
+}
+
+
+
+// the slower paths, kept out of run() so that their locals are destroyed
+// normally instead of being jumped over by the dispatch
+
+bool vm::make_list (int count)
+{
+	value result;
+	if (count == 0)
+		result = value::from_list(list::empty());
+	else
+	{
+		std::vector<value> items(stack.end() - count, stack.end());
+		result = value::from_list(list::basic(items));
+	}
+	stack.resize(stack.size() - count);
+	stack.push_back(result);
+	return true;
+}
+
+bool vm::eval_node (expression* e, const std::shared_ptr<closure>& local)
+{
+	value result;
+	state::scope scope(parent, local);
+	if (!e->eval(result, scope))
+		return false;
+	stack.push_back(result);
+	return true;
+}
+
+// a call the node ends in replaces the current frame, as in the tree
+// interpreter's trampoline, along with the concatenations it leaves
+bool vm::eval_tail (expression* e)
+{
+	expression::tail_call tc(frames.back().func);
+	value result;
+	{
+		state::scope scope(parent, frames.back().local);
+		if (!e->eval_tail_call(tc, result, scope))
+			return false;
+	}
+	
+	// nested calls may have moved the frames
+	frame& fr = frames.back();
+	for (auto& p : tc.pending)
+		fr.pending.push_back(p);
+	
+	if (!tc.do_tail)
+	{
+		stack.push_back(result);
+		return true;
+	}
+	
+	bool memoized = static_cast<soft_function*>(tc.target.get())->memo() != nullptr;
+	stack.push_back(value::from_function(tc.target));
+	for (auto& v : tc.args)
+		stack.push_back(v);
+	return memoized ? call_value(tc.args.size()) : tail_call(fr, tc.args.size());
+}
+
+bool vm::finish (frame& fr, value& result)
+{
+	expression::tail_call tc(nullptr);
+	tc.pending.swap(fr.pending);
+	return tc.finish(result, parent);
+}
+
+// natives, memoized functions and numbers
+bool vm::call_value (int nargs)
+{
+	size_t callee = stack.size() - nargs - 1;
+	value func = stack[callee], result;
+	
+	argument_list args(nargs);
+	for (int i = 0; i < nargs; i++)
+		args.values[i] = stack[callee + 1 + i];
+	stack.resize(callee);
+	
+	if (!func.call(result, args, parent))
+		return false;
+	stack.push_back(result);
+	return true;
+}
+
+bool vm::tail_call (frame& fr, int nargs)
+{
+	size_t callee = stack.size() - nargs - 1;
+	auto ref = stack[callee].func_obj;
+	auto f = static_cast<soft_function*>(ref.get());
+	
+	std::shared_ptr<closure> local(new closure(nargs,
+		f->parent_closure, f->closure_cache_size()));
+	for (int i = 0; i < nargs; i++)
+		local->set(i, stack[callee + 1 + i]);
+	
+	fr.func = f;
+	fr.ref = ref;
+	fr.local = local;
+	return enter(fr, 0);
+}
+
+
+
+#if defined(__GNUC__)
+#define XY_VM_COMPUTED_GOTO
+#endif
+
+#ifdef XY_VM_COMPUTED_GOTO
+	#define VM_LABEL(name) &&do_##name,
+	#define VM_CASE(name)  do_##name:
+	#define VM_NEXT()      in = ip++; goto *labels[in->op]
+#else
+	#define VM_CASE(name)  case bytecode::op_##name:
+	#define VM_NEXT()      goto dispatch
+#endif
+
+// 'fr', 'ip' and 'code' are reloaded after anything that may re-enter the
+// vm, since the frame and stack vectors can be reallocated by nested calls.
+// the dispatch jumps out of blocks without running destructors, so values
+// are only held in variables declared up here
+bool vm::run (value& out, size_t base)
+{
+	frame* fr = &frames.back();
+	const bytecode::instr* ip = fr->ip;
+	const bytecode::instr* in;
+	bytecode* code = fr->code;
+	value result;
+	size_t top;
+	bool good;
+
+#define VM_LOAD() \
+	fr = &frames.back(); ip = fr->ip; code = fr->code
+#define VM_SAVE() \
+	fr->ip = ip
+
+#ifdef XY_VM_COMPUTED_GOTO
+	static void* labels[] = { XY_OPCODES(VM_LABEL) };
+	VM_NEXT();
+#else
+dispatch:
+	in = ip++;
+	switch (in->op)
+	{
+#endif
+
+	VM_CASE(const)
+		stack.push_back(code->constants[in->a]);
+		VM_NEXT();
+
+	VM_CASE(local)
+		stack.push_back(fr->local->get(in->a, in->b));
+		VM_NEXT();
+
+	VM_CASE(slot)
+		stack.push_back(fr->local->slot(in->a));
+		VM_NEXT();
+
+	VM_CASE(set_slot)
+		fr->local->slot(in->a) = stack.back();
+		stack.pop_back();
+		VM_NEXT();
+
+	VM_CASE(cached)
+		if (fr->local->cached(in->a, result))
+		{
+			stack.push_back(result);
+			ip = code->code.data() + in->b;
+		}
+		VM_NEXT();
+
+	VM_CASE(cache)
+		fr->local->cache(in->a, stack.back());
+		VM_NEXT();
+
+	VM_CASE(binary)
+		top = stack.size();
+		if (!stack[top - 2].apply_operator(result, in->a, stack[top - 1], parent))
+			return false;
+		stack.pop_back();
+		stack.back() = result;
+		VM_NEXT();
+
+	VM_CASE(unary)
+		if (!stack.back().apply_unary(result, in->a, parent))
+			return false;
+		stack.back() = result;
+		VM_NEXT();
+
+	VM_CASE(and)
+		if (!stack.back().condition())
+			ip = code->code.data() + in->b;
+		else
+			stack.pop_back();
+		VM_NEXT();
+
+	VM_CASE(or)
+		if (stack.back().condition())
+			ip = code->code.data() + in->b;
+		else
+			stack.pop_back();
+		VM_NEXT();
+
+	VM_CASE(list)
+		make_list(in->a);
+		VM_NEXT();
+
+	VM_CASE(eval)
+		VM_SAVE();
+		if (!eval_node(code->nodes[in->a], fr->local))
+			return false;
+		VM_LOAD();
+		VM_NEXT();
+
+	VM_CASE(eval_tail)
+		VM_SAVE();
+		if (!eval_tail(code->nodes[in->a]))
+			return false;
+		VM_LOAD();
+		VM_NEXT();
+
+	VM_CASE(pend)
+		fr->pending.push_back({ stack.back(), true });
+		stack.pop_back();
+		VM_NEXT();
+
+	VM_CASE(guard)
+		good = stack.back().condition();
+		stack.pop_back();
+		if (!good)
+		{
+			if (!enter(*fr, fr->overload + 1))
+				return false;
+			ip = fr->ip;
+			code = fr->code;
+		}
+		VM_NEXT();
+
+	VM_CASE(call)
+	VM_CASE(tail_call)
+		top = stack.size() - in->a - 1;
+		// memoized functions are called through their table
+		if (stack[top].type == value::type_function &&
+				!stack[top].func_obj->is_native() &&
+				static_cast<soft_function*>(stack[top].func_obj.get())->memo() == nullptr)
+		{
+			if (in->op == bytecode::op_tail_call)
+			{
+				if (!tail_call(*fr, in->a))
+					return false;
+				ip = fr->ip;
+				code = fr->code;
+				VM_NEXT();
+			}
+			else
+			{
+				// the callee stays on the stack below the new frame
+				VM_SAVE();
+				if (!push_frame(static_cast<soft_function*>(stack[top].func_obj.get()),
+						stack[top].func_obj, in->a))
+					return false;
+				VM_LOAD();
+				VM_NEXT();
+			}
+		}
+
+		VM_SAVE();
+		if (!call_value(in->a))
+			return false;
+		VM_LOAD();
+		VM_NEXT();
+
+	VM_CASE(return)
+		result = stack.back();
+		if (!fr->pending.empty() && !finish(*fr, result))
+			return false;
+		stack.resize(fr->stack_base);
+		frames.pop_back();
+
+		if (frames.size() == base)
+		{
+			out = result;
+			return true;
+		}
+
+		stack.back() = result;
+		VM_LOAD();
+		VM_NEXT();
+
+#ifndef XY_VM_COMPUTED_GOTO
+	}
+	return false;
+#endif
+
+#undef VM_LOAD
+#undef VM_SAVE
+}
+
+
+};
@@ -0,0 +1,103 @@
+#pragma once
+#include "state.h"
+#include "value.h"
+#include "expression.h"
+
+namespace xy {
+
+class soft_function;
+struct func_body;
+struct argument_list;
+
+
+#define XY_OPCODES(X)                                                        \
+	X(const)      /* push constants[a]                                    */ \
+	X(local)      /* push closure value a at depth b                      */ \
+	X(slot)       /* push hidden slot a                                   */ \
+	X(set_slot)   /* pop into hidden slot a                               */ \
+	X(cached)     /* push cached slot a and jump to b, if filled          */ \
+	X(cache)      /* store the top in cache slot a                        */ \
+	X(binary)     /* apply operator a to the top two values               */ \
+	X(unary)      /* apply unary operator a to the top                    */ \
+	X(and)        /* jump to b keeping the top if false, else pop it      */ \
+	X(or)         /* jump to b keeping the top if true, else pop it       */ \
+	X(list)       /* replace the top a values with a list                 */ \
+	X(eval)       /* push the value of nodes[a], by the tree interpreter  */ \
+	X(eval_tail)  /* as 'eval' in tail position, which may end in a call  */ \
+	X(pend)       /* pop a list to concatenate before the frame's result  */ \
+	X(guard)      /* pop, and try the next overload if false              */ \
+	X(call)       /* call the function below the top a values             */ \
+	X(tail_call)  /* as 'call', replacing the current frame               */ \
+	X(return)     /* return the top from the current frame                */
+
+// the compiled guards and body of one overload; the values of the closure
+// are used as registers, and temporaries live on the vm's stack
+struct bytecode
+{
+#define XY_OPCODE_ENUM(name) op_##name,
+	enum opcode { XY_OPCODES(XY_OPCODE_ENUM) };
+#undef XY_OPCODE_ENUM
+
+	struct instr
+	{
+		opcode op;
+		int a, b;
+	};
+
+	std::vector<instr> code;
+	std::vector<value> constants;
+	std::vector<expression*> nodes;
+
+	// returns the index of the instruction
+	int emit (opcode op, int a = 0, int b = 0);
+	// sets the jump target of instruction 'at' to the next one emitted
+	void patch (int at);
+	int add_const (const value& v);
+	int add_node (expression* e);
+
+	static std::shared_ptr<bytecode> compile (func_body& body);
+};
+
+
+// runs soft functions from their bytecode; calls between soft functions
+// push frames on the heap instead of recursing
+class vm
+{
+public:
+	vm (state& parent);
+
+	bool call (value& out, soft_function* f, const argument_list& args);
+
+private:
+	struct frame
+	{
+		soft_function* func;
+		std::shared_ptr<function> ref;
+		std::shared_ptr<closure> local;
+		int overload;
+		bytecode* code;
+		const bytecode::instr* ip;
+		size_t stack_base;
+		// as in '[x] + f(y)', kept across the tail calls of the frame
+		std::vector<expression::tail_call::pending_concat> pending;
+	};
+	// roughly what a frame and its closure take on the heap
+	static const size_t frame_bytes = sizeof(frame) + sizeof(closure) + 2 * sizeof(value);
+
+	state& parent;
+	std::vector<value> stack;
+	std::vector<frame> frames;
+
+	bool enter (frame& fr, int overload);
+	bool push_frame (soft_function* f, const std::shared_ptr<function>& ref, int nargs);
+	bool tail_call (frame& fr, int nargs);
+	bool call_value (int nargs);
+	bool make_list (int count);
+	bool eval_node (expression* e, const std::shared_ptr<closure>& local);
+	bool eval_tail (expression* e);
+	bool finish (frame& fr, value& result);
+	bool run (value& out, size_t base);
+};
+
+
+};
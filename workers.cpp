@@ -0,0 +1,367 @@
+#include "include.h"
+#include "workers.h"
+#include "function.h"
+
+#include <chrono>
+
+namespace xy {
+
+
+// lists whose items would take less than this in total are not worth
+// handing out, and chunks are sized to take about XY_CHUNK_NS each
+#define XY_PARALLEL_MIN_NS  100000
+#define XY_CHUNK_NS         50000
+// functions whose spawned calls have all taken less than this are called
+// right away instead
+#define XY_SPAWN_MIN_NS     20000
+
+
+
+worker_pool::worker_pool (state& o, int threads)
+	: owner(o), queued(0), live(0),
+	  current(nullptr), generation(0), busy(0),
+	  running(false), stopping(false)
+{
+	for (int i = 0; i <= threads; i++)
+		deques.push_back(std::shared_ptr<deque>(new deque()));
+	
+	for (int i = 0; i < threads; i++)
+	{
+		std::shared_ptr<worker> w(new worker());
+		w->pool = this;
+		w->index = i + 1;
+		w->local = std::shared_ptr<state>(new state(owner));
+		
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		w->started =
+			pthread_attr_setstacksize(&attr, owner.get_stack_size()) == 0 &&
+			pthread_create(&w->thread, &attr, worker_main, w.get()) == 0;
+		pthread_attr_destroy(&attr);
+		
+		if (!w->started)
+			break;
+		workers.push_back(w);
+	}
+}
+
+worker_pool::~worker_pool ()
+{
+	{
+		std::lock_guard<std::mutex> l(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	
+	for (auto& w : workers)
+		pthread_join(w->thread, nullptr);
+}
+
+
+void* worker_pool::worker_main (void* p)
+{
+	auto w = static_cast<worker*>(p);
+	auto pool = w->pool;
+	w->local->guard_stack();
+	
+	long seen = 0;
+	for (;;)
+	{
+		job* j = nullptr;
+		{
+			std::unique_lock<std::mutex> l(pool->lock);
+			pool->wake.wait(l, [&]
+			{
+				return pool->stopping || pool->generation != seen || pool->queued > 0;
+			});
+			if (pool->stopping)
+				return nullptr;
+			if (pool->generation != seen)
+			{
+				seen = pool->generation;
+				j = pool->current;
+			}
+		}
+		
+		if (j == nullptr)
+		{
+			pool->run_queued(w->index, *w->local);
+			continue;
+		}
+		
+		work(*j, *w->local);
+		
+		std::lock_guard<std::mutex> l(pool->lock);
+		if (--pool->busy == 0)
+			pool->done.notify_all();
+	}
+}
+
+void worker_pool::work (job& j, state& s)
+{
+	for (;;)
+	{
+		int start = j.next.fetch_add(j.chunk);
+		int end = std::min(start + j.chunk, j.count);
+		
+		for (int i = start; i < end; i++)
+		{
+			// items past an error would not have been reached
+			if (i > j.failed.load(std::memory_order_relaxed))
+				return;
+			
+			if (!(*j.fn)(i, s))
+			{
+				std::lock_guard<std::mutex> l(j.error_lock);
+				std::string message(s.error().flush());
+				if (i < j.failed)
+				{
+					j.failed = i;
+					j.error = message;
+				}
+				return;
+			}
+		}
+		
+		if (end >= j.count)
+			return;
+	}
+}
+
+bool worker_pool::run (int first, int count, int chunk, const task& fn)
+{
+	job j;
+	j.fn = &fn;
+	j.count = count;
+	j.chunk = chunk;
+	j.next = first;
+	j.failed = count;
+	
+	{
+		std::lock_guard<std::mutex> l(lock);
+		current = &j;
+		busy = workers.size();
+		generation++;
+		running = true;
+	}
+	wake.notify_all();
+	
+	work(j, owner);
+	
+	{
+		std::unique_lock<std::mutex> l(lock);
+		done.wait(l, [&] { return busy == 0; });
+		current = nullptr;
+		running = false;
+	}
+	
+	if (j.failed < count)
+	{
+		owner.error().die() << j.error;
+		return false;
+	}
+	return true;
+}
+
+
+bool worker_pool::each (state& s, int count, const task& fn)
+{
+	if (count == 0)
+		return true;
+	
+	// the first item is timed, to tell how many to hand out at once
+	auto begin = std::chrono::steady_clock::now();
+	if (!fn(0, s))
+		return false;
+	long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - begin).count();
+	
+	// nested parallel natives run serially, inside workers or not, and so
+	// do those made while spawned calls may be holding up the workers
+	worker_pool* pool = s.workers();
+	if (pool == nullptr || pool->workers.size() == 0 || pool->running ||
+			pool->live > 0 || ns * (count - 1) < XY_PARALLEL_MIN_NS)
+	{
+		for (int i = 1; i < count; i++)
+			if (!fn(i, s))
+				return false;
+		return true;
+	}
+	
+	long chunk = XY_CHUNK_NS / std::max(ns, 1L);
+	long balanced = (count - 1) / (4 * pool->size());
+	chunk = std::max(1L, std::min(chunk, balanced));
+	return pool->run(1, count, (int)chunk, fn);
+}
+
+
+
+bool worker_pool::idle (state& s)
+{
+	if (s.is_worker())
+		return false;
+	worker_pool* pool = s.pool.get();
+	return pool == nullptr || (!pool->running && pool->live == 0);
+}
+
+
+
+future::future (const std::shared_ptr<function>& f)
+	: func(f), body(nullptr), pool(nullptr), status(pending), failed(false)
+{
+	if (!f->is_native())
+	{
+		auto& bodies = static_cast<soft_function*>(f.get())->bodies();
+		if (bodies.size() > 0)
+			body = bodies[0].get();
+	}
+}
+
+worker_pool* worker_pool::of (state& s)
+{
+	return s.is_worker() ? s.owner->pool.get() : s.workers();
+}
+
+int worker_pool::index (state& s) const
+{
+	for (int i = 0, size = workers.size(); i < size; i++)
+		if (workers[i]->local.get() == &s)
+			return workers[i]->index;
+	return 0;
+}
+
+
+bool worker_pool::spawn (value& out, const std::shared_ptr<function>& f, state& s)
+{
+	std::shared_ptr<future> fut(new future(f));
+	out = value::from_future(fut);
+	
+	worker_pool* pool = of(s);
+	long ns = fut->body == nullptr ? -1 : fut->body->spawn_ns.load(std::memory_order_relaxed);
+	if (pool == nullptr || pool->workers.size() == 0 || (ns >= 0 && ns < XY_SPAWN_MIN_NS))
+	{
+		fut->claim();
+		execute(*fut, s);
+		return true;
+	}
+	
+	fut->pool = pool;
+	pool->live++;
+	{
+		auto& d = *pool->deques[pool->index(s)];
+		std::lock_guard<std::mutex> l(d.lock);
+		d.calls.push_back(fut);
+	}
+	pool->queued++;
+	{
+		std::lock_guard<std::mutex> l(pool->lock);
+	}
+	pool->wake.notify_all();
+	return true;
+}
+
+bool worker_pool::await (value& out, const value& v, state& s)
+{
+	future& f = *v.future_obj;
+	
+	if (f.claim())
+	{
+		execute(f, s);
+		f.pool->settle();
+	}
+	else if (!f.settled())
+	{
+		// states of other pools only wait
+		worker_pool* pool = f.pool;
+		int thread = of(s) == pool ? pool->index(s) : -1;
+		
+		while (!f.settled())
+		{
+			if (thread >= 0 && pool->run_queued(thread, s))
+				continue;
+			
+			std::unique_lock<std::mutex> l(pool->lock);
+			pool->wake.wait(l, [&]
+			{
+				return f.settled() || (thread >= 0 && pool->queued > 0);
+			});
+		}
+	}
+	
+	if (f.failed)
+	{
+		s.error().die() << f.error;
+		return false;
+	}
+	out = f.result;
+	return true;
+}
+
+
+// runs a queued call: the newest of 'thread' itself, else the oldest of
+// another; false if there are none
+bool worker_pool::run_queued (int thread, state& s)
+{
+	for (int k = 0, n = deques.size(); k < n; k++)
+	{
+		auto& d = *deques[(thread + k) % n];
+		std::shared_ptr<future> f;
+		{
+			std::lock_guard<std::mutex> l(d.lock);
+			if (d.calls.empty())
+				continue;
+			if (k == 0)
+			{
+				f = d.calls.back();
+				d.calls.pop_back();
+			}
+			else
+			{
+				f = d.calls.front();
+				d.calls.pop_front();
+			}
+		}
+		queued--;
+		
+		// left in the deque by whoever awaited it first
+		if (f->claim())
+		{
+			execute(*f, s);
+			settle();
+		}
+		return true;
+	}
+	return false;
+}
+
+void worker_pool::settle ()
+{
+	live--;
+	{
+		std::lock_guard<std::mutex> l(lock);
+	}
+	wake.notify_all();
+}
+
+void worker_pool::execute (future& f, state& s)
+{
+	auto begin = std::chrono::steady_clock::now();
+	f.failed = !f.func->call(f.result, argument_list(), s);
+	if (f.failed)
+		f.error = s.error().flush();
+	
+	if (f.body != nullptr)
+	{
+		long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - begin).count();
+		long longest = f.body->spawn_ns.load(std::memory_order_relaxed);
+		while (ns > longest && !f.body->spawn_ns.compare_exchange_weak(longest, ns))
+			;
+	}
+	
+	f.func = nullptr;
+	f.status = future::done;
+}
+
+
+};
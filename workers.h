@@ -0,0 +1,130 @@
+#pragma once
+#include "state.h"
+#include "value.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <pthread.h>
+
+namespace xy {
+
+class function;
+struct func_body;
+
+
+// the result of a call made by 'spawn', on some thread of the pool; taken
+// by whichever thread gets to it first, the one awaiting it included
+class future
+{
+public:
+	future (const std::shared_ptr<function>& f);
+	
+	enum { pending = 0, running, done };
+	
+	// takes the call on, unless another thread has
+	inline bool claim ()
+	{
+		int expect = pending;
+		return status.compare_exchange_strong(expect, running);
+	}
+	inline bool settled () const { return status.load() == done; }
+
+private:
+	friend class worker_pool;
+	
+	std::shared_ptr<function> func;
+	func_body* body; // timed, to tell whether spawning it is worth it
+	worker_pool* pool; // where it was queued, if it was
+	std::atomic<int> status;
+	value result;
+	bool failed;
+	std::string error;
+};
+
+
+// threads running the items of parallel natives such as 'pmap', each with a
+// state of its own that shares the program of the owner; the calling thread
+// takes part as well, with its own state
+class worker_pool
+{
+public:
+	typedef std::function<bool(int index, state& s)> task;
+	
+	worker_pool (state& owner, int threads);
+	~worker_pool ();
+	
+	// runs 'fn' once for every index in [0, count), on the workers if the
+	// items look costly enough, else serially on 's'. stops at an error,
+	// reporting that of the lowest failing index, as a serial loop would
+	static bool each (state& s, int count, const task& fn);
+	
+	inline int size () const { return (int)(workers.size()) + 1; }
+	
+	// whether no thread of the pool may be evaluating along with 's': it
+	// is no worker, and runs no parallel native and no spawned calls
+	static bool idle (state& s);
+	
+	// calls 'f' without arguments as a future: queued to the deque of the
+	// calling thread, for idle threads to steal, unless its earlier calls
+	// all took less than XY_SPAWN_MIN_NS, or there are no workers
+	static bool spawn (value& out, const std::shared_ptr<function>& f, state& s);
+	// the result of the future 'f', running it here if nobody has taken it
+	// yet, else running other queued calls until it is done
+	static bool await (value& out, const value& f, state& s);
+
+private:
+	struct job
+	{
+		const task* fn;
+		int count, chunk;
+		std::atomic<int> next;   // first index of the next chunk
+		std::atomic<int> failed; // lowest failing index, else 'count'
+		std::mutex error_lock;
+		std::string error;
+	};
+	
+	struct worker
+	{
+		worker_pool* pool;
+		std::shared_ptr<state> local;
+		pthread_t thread;
+		int index; // of its deque
+		bool started;
+	};
+	
+	// spawned calls of one thread: it pushes and pops at the back, others
+	// steal from the front
+	struct deque
+	{
+		std::mutex lock;
+		std::deque<std::shared_ptr<future>> calls;
+	};
+	
+	state& owner;
+	std::vector<std::shared_ptr<worker>> workers;
+	std::vector<std::shared_ptr<deque>> deques; // the owner's first
+	std::atomic<int> queued; // calls in the deques
+	std::atomic<int> live;   // calls spawned and not done
+	
+	std::mutex lock;
+	std::condition_variable wake, done;
+	job* current;
+	long generation;
+	int busy;
+	bool running, stopping;
+	
+	bool run (int first, int count, int chunk, const task& fn);
+	static void work (job& j, state& s);
+	static void* worker_main (void* p);
+	
+	static worker_pool* of (state& s);
+	int index (state& s) const;
+	bool run_queued (int thread, state& s);
+	void settle ();
+	static void execute (future& f, state& s);
+};
+
+
+};